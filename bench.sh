@@ -0,0 +1,34 @@
+#!/bin/sh
+# Benchmarks wfq.exe and new_wfq.exe on synthetic traces (run with "make bench").
+#
+# For each scenario, generates a trace with gen_trace.exe, runs the benchmark builds of both programs
+# (wfq_bench.exe and new_wfq_bench.exe, which are compiled with -DWFQ_PHASE_TIMING) on it,
+# and prints the throughput, the time per packet in each phase, and the peak RSS.
+#
+# Environment variables (and the ones of bench_lib.sh, which sets the trace size, the seed and the scenarios):
+#   BENCH_PROGRAMS   the programs to run (default: "wfq_bench.exe new_wfq_bench.exe")
+
+set -e
+
+. ./bench_lib.sh
+
+programs=${BENCH_PROGRAMS:-"wfq_bench.exe new_wfq_bench.exe"}
+
+printf "%-11s %-18s %12s %8s %8s %8s %8s %8s %10s\n" \
+    scenario program packets/s parse lookup enqueue schedule output "RSS KiB"
+for scenario in $scenarios; do
+    trace=$(scenario_trace "$scenario")
+    for program in $programs; do
+        report="$dir/report.txt"
+        "./$program" < "$trace" > /dev/null 2> "$report"
+        awk -v scenario="$scenario" -v program="$program" '
+            /^packets\/s:/ { rate = $2 }
+            /^ns\/packet/ { sub(":", "", $2); ns[$2] = $3 }
+            /^peak RSS KiB:/ { rss = $4 }
+            END {
+                printf "%-11s %-18s %12s %8s %8s %8s %8s %8s %10s\n", scenario, program, rate,
+                    ns["parse"], ns["lookup"], ns["enqueue"], ns["schedule"], ns["output"], rss
+            }' "$report"
+    done
+done
+echo "(phase columns are in ns/packet)"
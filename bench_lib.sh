@@ -0,0 +1,40 @@
+# The scenarios and traces shared by bench.sh and perf_gate.sh (sourced by both, from the directory of the Makefile).
+#
+# Environment variables:
+#   BENCH_PACKETS    the number of packets in each trace (default: 1000000)
+#   BENCH_SEED       the seed for gen_trace.exe (default: 1)
+#   BENCH_DIR        the directory for the generated traces (default: bench_traces)
+#   BENCH_SCENARIOS  the scenarios to run (default: all of them, see below)
+
+packets=${BENCH_PACKETS:-1000000}
+seed=${BENCH_SEED:-1}
+dir=${BENCH_DIR:-bench_traces}
+scenarios=${BENCH_SCENARIOS:-"few_flows many_flows weighted bursty"}
+
+# Prints the gen_trace.exe options of a scenario.
+scenario_options() {
+    case $1 in
+        few_flows) echo "--flows 100" ;;
+        many_flows) echo "--flows 100000" ;;
+        weighted) echo "--flows 1000 --weight-rate 0.1" ;;
+        bursty) echo "--flows 10000 --burst 64 --gap 20000 --lengths uniform:40-1500" ;;
+        *) echo "unknown scenario: $1" >&2; exit 1 ;;
+    esac
+}
+
+# Prints the path of the trace of a scenario, and generates it if it doesn't exist yet.
+scenario_trace() {
+    options=$(scenario_options "$1") || exit 1
+    trace="$dir/$1-$packets-$seed.txt"
+    if [ ! -f "$trace" ]; then
+        mkdir -p "$dir"
+        # shellcheck disable=SC2086
+        ./gen_trace.exe --packets "$packets" --seed "$seed" $options > "$trace"
+    fi
+    echo "$trace"
+}
+
+# Succeeds if no packet of the scenario's traces has an explicit weight.
+scenario_is_unweighted() {
+    [ "$1" != weighted ]
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// A compact binary format for traces (the input of wfq.exe) and for the output of wfq.exe,
+// so traces that are replayed many times don't have to be parsed and formatted as decimal text each time.
+// trace_convert.cpp converts between this format and the text format.
+//
+// A file starts with a BinaryHeader, followed by fixed-width records: BinaryPacketRecord's in a trace,
+// or BinaryOutputRecord's in an output file. Channel ids are assigned in the order in which channels first appear in
+// the file, and the first record of each channel is followed by the channel's connection string, as a uint32_t length
+// followed by the characters. So a file is written and read as a stream, and nothing is held back until all the
+// records are known. Numbers are stored in the machine's byte order (little-endian on all the platforms we build for).
+//
+// Files of version 1 have a connection table right after the header instead (the connection of each channel id,
+// in the same format), and no connections after the records. They can still be read.
+
+// The header of a binary file.
+struct BinaryHeader {
+    // A flag that is set if no packet of a trace has an explicit weight, so it can be replayed by the unweighted
+    // scheduler (see --unweighted in wfq.cpp). Files written before this flag was added have it clear.
+    static constexpr uint32_t no_weights = 1;
+
+    // binary_trace_magic or binary_output_magic.
+    char magic[4] = {};
+    uint32_t version = 0;
+    // The number of entries in the connection table (only in version 1).
+    uint32_t num_connections = 0;
+    uint32_t flags = 0;
+
+    bool has_magic(const char (&expected)[4]) const {
+        return std::memcmp(magic, expected, sizeof(magic)) == 0;
+    }
+};
+static_assert(sizeof(BinaryHeader) == 16);
+
+inline constexpr char binary_trace_magic[4] = { 'W', 'F', 'Q', 'T' };
+inline constexpr char binary_output_magic[4] = { 'W', 'F', 'Q', 'O' };
+inline constexpr uint32_t binary_format_version = 2;
+// The version of the files that have a connection table after the header.
+inline constexpr uint32_t binary_table_version = 1;
+
+// A packet in a binary trace.
+struct BinaryPacketRecord {
+    // A flag that is set if the packet has an explicit weight.
+    static constexpr uint32_t has_weight = 1;
+
+    // The time when the packet arrived.
+    uint64_t time = 0;
+    // The packet's length.
+    uint64_t length = 0;
+    // The packet's weight, if the has_weight flag is set.
+    double weight = 0;
+    // The id of the packet's channel.
+    uint32_t channel = 0;
+    uint32_t flags = 0;
+
+    static BinaryPacketRecord make(uint64_t time, uint32_t channel, uint64_t length, std::optional<double> weight) {
+        BinaryPacketRecord result;
+        result.time = time;
+        result.length = length;
+        result.channel = channel;
+        if (weight.has_value()) {
+            result.weight = *weight;
+            result.flags = has_weight;
+        }
+        return result;
+    }
+
+    std::optional<double> optional_weight() const {
+        if ((flags & has_weight) == 0) return std::nullopt;
+        return weight;
+    }
+};
+static_assert(sizeof(BinaryPacketRecord) == 32);
+
+// A transmitted packet in a binary output file.
+struct BinaryOutputRecord {
+    // The time when the packet was transmitted.
+    uint64_t transmit_time = 0;
+    BinaryPacketRecord packet;
+};
+static_assert(sizeof(BinaryOutputRecord) == 40);
+
+// Switches a standard stream to binary mode, so that on Windows "\n" bytes are not translated.
+inline void set_binary_mode(std::FILE* file) {
+#ifdef _WIN32
+    _setmode(_fileno(file), _O_BINARY);
+#else
+    (void)file;
+#endif
+}
+
+// Returns the header of a binary file, with the given flags.
+inline BinaryHeader make_binary_header(const char (&magic)[4], uint32_t flags = 0) {
+    BinaryHeader header;
+    std::memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = binary_format_version;
+    header.flags = flags;
+    return header;
+}
+
+// Writes the header of a binary file (with the given flags) through writer, which can be anything with
+// write_bytes(std::string_view), such as OutputWriter.
+template <class Writer>
+void write_binary_header(Writer& writer, const char (&magic)[4], uint32_t flags = 0) {
+    BinaryHeader header = make_binary_header(magic, flags);
+    writer.write_bytes(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+}
+
+// Writes a record of a binary file through writer (see write_binary_header). If it is the first record of its channel,
+// new_connection is the channel's connection, which is written after it.
+template <class Writer, class Record>
+void write_binary_record(Writer& writer, const Record& record, std::optional<std::string_view> new_connection) {
+    writer.write_bytes(std::string_view(reinterpret_cast<const char*>(&record), sizeof(record)));
+    if (!new_connection.has_value()) return;
+    uint32_t length = static_cast<uint32_t>(new_connection->size());
+    writer.write_bytes(std::string_view(reinterpret_cast<const char*>(&length), sizeof(length)));
+    writer.write_bytes(*new_connection);
+}
+
+// Reads the part of a binary file that read_bytes(size) returns (the next size bytes, or fewer at the end of the input)
+// into value. Returns false at the end of the input, or if the input ends in the middle of value.
+template <class T, class ReadBytes>
+bool read_binary(ReadBytes&& read_bytes, T& value) {
+    std::span<char> bytes = read_bytes(sizeof(T));
+    if (bytes.size() != sizeof(T)) return false;
+    std::memcpy(&value, bytes.data(), sizeof(T));
+    return true;
+}
+
+// Reads a connection string of a binary file (see read_binary), and adds it to connections.
+// Returns false if the input ends in the middle of it.
+template <class ReadBytes>
+bool read_binary_connection(ReadBytes&& read_bytes, std::vector<std::string>& connections) {
+    uint32_t length;
+    if (!read_binary(read_bytes, length)) return false;
+    std::span<char> connection = read_bytes(length);
+    if (connection.size() != length) return false;
+    connections.emplace_back(connection.data(), connection.size());
+    return true;
+}
+
+// Reads the header of a binary file (see read_binary), and the connection table of a version 1 file.
+// Returns the connection table (which is empty in later versions), or std::nullopt if the input does not start with
+// a valid header (and table).
+template <class ReadBytes>
+std::optional<std::vector<std::string>> read_binary_header(ReadBytes&& read_bytes, BinaryHeader& header) {
+    if (!read_binary(read_bytes, header)) return std::nullopt;
+    if (header.version != binary_format_version && header.version != binary_table_version) return std::nullopt;
+    if (!header.has_magic(binary_trace_magic) && !header.has_magic(binary_output_magic)) return std::nullopt;
+    std::vector<std::string> connections;
+    if (header.version != binary_table_version) return connections;
+    connections.reserve(header.num_connections);
+    for (uint32_t i = 0; i < header.num_connections; i++) {
+        if (!read_binary_connection(read_bytes, connections)) return std::nullopt;
+    }
+    return connections;
+}
+
+// Reads the connection that follows a record of the given channel (see read_binary) if it is the first record of its
+// channel, and adds it to connections, which holds the connections read so far (or a version 1 file's table).
+// Returns false if the channel id is not valid, or if the input ends in the middle of the connection.
+template <class ReadBytes>
+bool read_binary_record_connection(ReadBytes&& read_bytes, const BinaryHeader& header, uint32_t channel,
+    std::vector<std::string>& connections) {
+    if (channel < connections.size()) return true;
+    if (header.version == binary_table_version || channel != connections.size()) return false;
+    return read_binary_connection(read_bytes, connections);
+}
+
+// Writes the output of wfq.exe in the binary format through writer (see write_binary_header), a packet at a time.
+// Channel ids in the output are assigned in the order in which channels are first transmitted, which isn't the order
+// of wfq.exe's channel ids, so the writer keeps the output id of each channel id (4 bytes per channel).
+template <class Writer>
+class BinaryOutputWriter {
+public:
+    explicit BinaryOutputWriter(Writer& writer) : writer_(writer) {}
+
+    // Writes the header. Must be called before anything else is written.
+    void start() {
+        write_binary_header(writer_, binary_output_magic);
+    }
+
+    // Writes a packet (of the channel with the given id and connection) that was transmitted at the given time.
+    void write_packet(uint64_t time, uint64_t packet_time, uint32_t channel, std::string_view connection,
+        uint64_t length, std::optional<double> weight) {
+        if (channel >= output_ids_.size()) output_ids_.resize(channel + 1, no_id);
+        std::optional<std::string_view> new_connection;
+        if (output_ids_[channel] == no_id) {
+            output_ids_[channel] = num_channels_++;
+            new_connection = connection;
+        }
+        BinaryOutputRecord record{ time, BinaryPacketRecord::make(packet_time, output_ids_[channel], length, weight) };
+        write_binary_record(writer_, record, new_connection);
+    }
+
+private:
+    // The output id of a channel that wasn't transmitted yet.
+    static constexpr uint32_t no_id = UINT32_MAX;
+
+    Writer& writer_;
+    // The output id of each channel id, or no_id.
+    std::vector<uint32_t> output_ids_;
+    uint32_t num_channels_ = 0;
+};
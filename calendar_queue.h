@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// A calendar queue (R. Brown, 1988): a priority queue with amortized O(1) push and pop,
+// for keys that mostly grow over time, like the virtual finish times in WFQ.
+//
+// The key line is divided into "days" of a fixed width, and day d is stored in bucket d % (number of buckets),
+// so a bucket holds the entries of one day in every "year". Popping scans the buckets from the current day onwards,
+// until it finds an entry that belongs to the day of its bucket. The number of buckets and the width of a day are
+// recomputed as the queue grows and shrinks, so that each bucket holds about one entry.
+//
+// CalendarQueue is a drop-in replacement for std::priority_queue<Entry>, with the same interface (push, top, pop, empty, size)
+// and the same order: Entry::operator< is used like in std::priority_queue, so top() is the largest entry.
+// Entry must also have an arithmetic member priority_snapshot (a double, or an integer such as a fixed-point time),
+// which must order the entries the same way (a larger priority_snapshot means a smaller entry); entries with equal
+// priority_snapshot are ordered by operator<. Keys are converted to double to find their bucket, which keeps their order
+// (keys that become equal just share a day, and are still ordered by operator< in their bucket).
+// Since the order is the same as std::priority_queue's, ties are broken exactly the same way.
+template <class Entry>
+class CalendarQueue {
+public:
+    CalendarQueue() : buckets_(min_buckets) {}
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    void push(const Entry& entry) {
+        insert(entry);
+        if (calendar_size_ > 2 * buckets_.size()) resize(buckets_.size() * 2);
+    }
+
+    // Adds the entries [first, last), like push() for each of them, but the calendar is resized once at the end,
+    // instead of every time it doubles.
+    template <class Iterator>
+    void push_range(Iterator first, Iterator last) {
+        for (; first != last; ++first) insert(*first);
+        size_t num_buckets = buckets_.size();
+        while (calendar_size_ > 2 * num_buckets) num_buckets *= 2;
+        if (num_buckets != buckets_.size()) resize(num_buckets);
+    }
+
+    const Entry& top() {
+        assert(!empty());
+        find_min();
+        return min_in_far_ ? far_.front() : buckets_[min_bucket_].front();
+    }
+
+    void pop() {
+        assert(!empty());
+        find_min();
+        if (min_in_far_) {
+            std::pop_heap(far_.begin(), far_.end());
+            far_.pop_back();
+        }
+        else {
+            std::vector<Entry>& bucket = buckets_[min_bucket_];
+            std::pop_heap(bucket.begin(), bucket.end());
+            bucket.pop_back();
+            calendar_size_--;
+        }
+        size_--;
+        min_valid_ = false;
+        if (buckets_.size() > min_buckets && calendar_size_ < buckets_.size() / 2) resize(buckets_.size() / 2);
+    }
+
+private:
+    static constexpr size_t min_buckets = 16;
+    // Keys whose day is beyond this (or that are not finite) are stored in far_.
+    static constexpr double max_day = 4.0e18;
+
+    bool is_calendar_key(double key) const {
+        double day = std::floor(key / width_);
+        return day > -max_day && day < max_day;
+    }
+
+    int64_t day_of(double key) const {
+        return static_cast<int64_t>(std::floor(key / width_));
+    }
+
+    size_t bucket_of(int64_t day) const {
+        return static_cast<size_t>(static_cast<uint64_t>(day) & (buckets_.size() - 1));
+    }
+
+    // Adds an entry, without resizing the calendar.
+    void insert(const Entry& entry) {
+        double key = static_cast<double>(entry.priority_snapshot);
+        if (!is_calendar_key(key)) {
+            // Keys that are too far away (or infinite) are kept in a separate heap.
+            far_.push_back(entry);
+            std::push_heap(far_.begin(), far_.end());
+        }
+        else {
+            int64_t day = day_of(key);
+            push_to_bucket(buckets_[bucket_of(day)], entry);
+            // A key before the current day moves the current day back (WFQ never does this, as finish times
+            // are at least the virtual time, but it keeps the queue correct for any keys).
+            if (calendar_size_ == 0 || day < current_day_) current_day_ = day;
+            calendar_size_++;
+        }
+        size_++;
+        min_valid_ = false;
+    }
+
+    // Inserts an entry into a bucket. Each bucket is a std heap, so its largest entry is at the front.
+    // (Buckets usually hold about one entry, but a heap also handles many entries with the same key,
+    // like a burst of equal-length packets arriving at the same time, without quadratic behaviour.)
+    static void push_to_bucket(std::vector<Entry>& bucket, const Entry& entry) {
+        bucket.push_back(entry);
+        std::push_heap(bucket.begin(), bucket.end());
+    }
+
+    // Finds the largest entry, and saves its location in min_bucket_ and min_in_far_.
+    // (It is the entry with the minimal key, hence the name.)
+    void find_min() {
+        if (min_valid_) return;
+        min_valid_ = true;
+        min_in_far_ = false;
+        if (calendar_size_ == 0) {
+            min_in_far_ = true;
+            return;
+        }
+        const Entry* best = nullptr;
+        // Scan one year from the current day, looking for an entry of the day that each bucket currently represents.
+        for (size_t i = 0; i < buckets_.size(); i++) {
+            int64_t day = current_day_ + static_cast<int64_t>(i);
+            const std::vector<Entry>& bucket = buckets_[bucket_of(day)];
+            if (!bucket.empty() && day_of(static_cast<double>(bucket.front().priority_snapshot)) == day) {
+                current_day_ = day;
+                min_bucket_ = bucket_of(day);
+                best = &bucket.front();
+                break;
+            }
+        }
+        if (best == nullptr) {
+            // No entry in the next year: search all the buckets directly, and jump to the day of the smallest key.
+            for (size_t b = 0; b < buckets_.size(); b++) {
+                if (!buckets_[b].empty() && (best == nullptr || *best < buckets_[b].front())) {
+                    best = &buckets_[b].front();
+                    min_bucket_ = b;
+                }
+            }
+            current_day_ = day_of(static_cast<double>(best->priority_snapshot));
+        }
+        if (!far_.empty() && *best < far_.front()) min_in_far_ = true;
+    }
+
+    // Changes the number of buckets, choosing a new day width from the keys in the queue.
+    void resize(size_t num_buckets) {
+        std::vector<Entry> entries;
+        entries.reserve(calendar_size_);
+        for (std::vector<Entry>& bucket : buckets_) {
+            entries.insert(entries.end(), bucket.begin(), bucket.end());
+        }
+        width_ = choose_width(entries);
+        buckets_.assign(num_buckets, {});
+        calendar_size_ = 0;
+        for (const Entry& entry : entries) {
+            if (!is_calendar_key(static_cast<double>(entry.priority_snapshot))) {
+                far_.push_back(entry);
+                std::push_heap(far_.begin(), far_.end());
+                continue;
+            }
+            int64_t day = day_of(static_cast<double>(entry.priority_snapshot));
+            push_to_bucket(buckets_[bucket_of(day)], entry);
+            if (calendar_size_ == 0 || day < current_day_) current_day_ = day;
+            calendar_size_++;
+        }
+        min_valid_ = false;
+    }
+
+    // Chooses a day width of about 3 times the average gap between the smallest keys (as suggested by Brown),
+    // ignoring unusually large gaps. Keeps the current width if the keys don't give a useful estimate.
+    double choose_width(std::vector<Entry>& entries) const {
+        constexpr size_t num_samples = 32;
+        std::vector<double> keys;
+        keys.reserve(entries.size());
+        for (const Entry& entry : entries) keys.push_back(static_cast<double>(entry.priority_snapshot));
+        size_t n = std::min(num_samples, keys.size());
+        if (n < 2) return width_;
+        std::partial_sort(keys.begin(), keys.begin() + n, keys.end());
+        double average = (keys[n - 1] - keys[0]) / static_cast<double>(n - 1);
+        double sum = 0;
+        size_t count = 0;
+        for (size_t i = 1; i < n; i++) {
+            double gap = keys[i] - keys[i - 1];
+            if (gap <= 2 * average) {
+                sum += gap;
+                count++;
+            }
+        }
+        double width = count == 0 ? 0 : 3 * sum / static_cast<double>(count);
+        if (!(width > 0) || !std::isfinite(width)) return width_;
+        return width;
+    }
+
+    // buckets_[b] holds the entries of the days d with d % buckets_.size() == b (see push_to_bucket).
+    std::vector<std::vector<Entry>> buckets_;
+    // Entries whose keys can't be placed on the calendar, as a std heap.
+    std::vector<Entry> far_;
+    // The width of a day.
+    double width_ = 1024.0;
+    // No entry in buckets_ has a day before this one.
+    int64_t current_day_ = 0;
+    // The number of entries in buckets_, and in total.
+    size_t calendar_size_ = 0;
+    size_t size_ = 0;
+    // The location of the largest entry, as computed by find_min(), if min_valid_ is true.
+    bool min_valid_ = false;
+    bool min_in_far_ = false;
+    size_t min_bucket_ = 0;
+};
@@ -0,0 +1,116 @@
+#!/bin/sh
+# Regression tests of wfq.exe (and new_wfq.exe) on small hand-written traces (run with "make check").
+# Exits with an error if any test fails.
+#
+# Each test runs wfq.exe (with some options) on a short input, and compares its output with the expected one.
+# The variants of wfq.exe that must write the same output are checked on the inputs of every test.
+
+set -e
+
+failures=0
+
+# The program that check runs.
+program=./wfq.exe
+
+# Runs $program with the options $2 on the input $3, and checks that it writes the output $4.
+# $1 is the name of the test.
+check() {
+    actual=$(printf "$3" | $program $2) || true
+    expected=$(printf "$4")
+    if [ "$actual" = "$expected" ]; then
+        printf "%-50s ok\n" "$1"
+    else
+        printf "%-50s FAILED\n" "$1"
+        printf "expected:\n%s\nactual:\n%s\n" "$expected" "$actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# The variants of wfq.exe whose output must be the same on any input.
+variants='"" "--pipelined" "--parse-threads 2" "--packed-keys" "--shards 1" "--streaming" "--immediate-weights"'
+
+# Runs check with each variant of wfq.exe whose output must be the same on an unweighted input.
+# (--class-prefix 1 is the same as wfq.exe as long as each source address has a single channel.)
+check_all() {
+    eval "set -- \"\$1\" \"\$2\" \"\$3\" $variants \"--unweighted\" \"--class-prefix 1\""
+    check_variants "$@"
+}
+
+# Runs check with each variant of wfq.exe whose output must be the same on a weighted input.
+check_weighted() {
+    eval "set -- \"\$1\" \"\$2\" \"\$3\" $variants"
+    check_variants "$@"
+}
+
+# Runs check with the name $1, the input $2 and the output $3, and each of the options that follow.
+check_variants() {
+    name=$1
+    input=$2
+    output=$3
+    shift 3
+    for options in "$@"; do
+        check "$name${options:+ ($options)}" "$options" "$input" "$output"
+    done
+}
+
+# Runs check with the name $1, the input $2 and the output $3, with the input and the output in the binary format
+# (converted with trace_convert.exe), which are streamed: a channel's connection follows its first record.
+check_binary() {
+    for options in "" "--pipelined" "--shards 1" "--io-uring"; do
+        actual=$(printf "$2" | ./trace_convert.exe to-binary | ./wfq.exe --input-format binary --output-format binary \
+            $options | ./trace_convert.exe to-text) || true
+        expected=$(printf "$3")
+        name="$1 (binary${options:+, $options})"
+        if [ "$actual" = "$expected" ]; then
+            printf "%-50s ok\n" "$name"
+        else
+            printf "%-50s FAILED\n" "$name"
+            printf "expected:\n%s\nactual:\n%s\n" "$expected" "$actual"
+            failures=$((failures + 1))
+        fi
+    done
+}
+
+# When the link is idle, it starts again at the arrival time of the packet it sends next: with out-of-order input,
+# that is not the last packet read, and no packet is sent before it arrives.
+check_all "idle link, out-of-order input" \
+    "10 a 1 b 2 100\n5 c 1 d 2 100\n" \
+    "10: 10 a 1 b 2 100\n110: 5 c 1 d 2 100\n"
+check_all "idle link, out-of-order input, earlier packet first" \
+    "10 a 1 b 2 1000\n5 c 1 d 2 10\n" \
+    "5: 5 c 1 d 2 10\n15: 10 a 1 b 2 1000\n"
+check_all "idle link, after a busy period" \
+    "0 a 1 b 2 100\n100 a 1 b 2 50\n200 c 1 d 2 10\n" \
+    "0: 0 a 1 b 2 100\n100: 100 a 1 b 2 50\n200: 200 c 1 d 2 10\n"
+
+# new_wfq.exe keeps its own rule: an idle link starts again at the arrival time of the first packet read after it.
+program=./new_wfq.exe
+check "new_wfq.exe: idle link, out-of-order input" "" \
+    "10 a 1 b 2 1000\n5 c 1 d 2 10\n" \
+    "10: 5 c 1 d 2 10\n20: 10 a 1 b 2 1000\n"
+check "new_wfq.exe: idle link, after a busy period" "" \
+    "0 a 1 b 2 100\n100 c 1 d 2 50\n200 a 1 b 2 10\n" \
+    "0: 0 a 1 b 2 100\n100: 100 c 1 d 2 50\n200: 200 a 1 b 2 10\n"
+program=./wfq.exe
+
+# Weights are read the same way as with sscanf's %lf (see packet_parser_test.cpp for the other cases).
+check_weighted "hexadecimal weight" \
+    "0 c 1 d 2 100\n0 a 1 b 2 100 0x10\n" \
+    "0: 0 a 1 b 2 100 16.00\n100: 0 c 1 d 2 100\n"
+
+# As with sscanf, the characters right after a number start the next field, so "100abc" is a length without a weight,
+# and "5a" is a time followed by the source address.
+check_all "numbers followed by other characters" \
+    "0 a 1 b 2 100abc 1e400\n5a 1 b 2 100\n" \
+    "0: 0 a 1 b 2 100\n100: 5 a 1 b 2 100\n"
+
+# Channels first appear in different orders in the input and in the output, so their ids are mapped again.
+check_binary "binary input and output" \
+    "0 a 1 b 2 100\n0 c 1 d 2 100 2\n10 e 1 f 2 10\n20 a 1 b 2 50\n" \
+    "0: 0 c 1 d 2 100 2.00\n100: 10 e 1 f 2 10\n110: 0 a 1 b 2 100\n210: 20 a 1 b 2 50\n"
+
+if [ $failures -ne 0 ]; then
+    echo "$failures tests failed"
+    exit 1
+fi
+echo "all tests passed"
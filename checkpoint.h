@@ -0,0 +1,263 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "binary_trace.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Checkpoints of the state of wfq.exe (see --checkpoint and --resume in wfq.cpp), so that a long replay that stops
+// can be resumed from its last checkpoint, instead of from the start of the trace.
+//
+// A checkpoint file starts with a CheckpointHeader (the state of the driver, the input offset and the output position),
+// followed by fixed-width records: a CheckpointChannel for each channel in memory, the packets in the channels' queues
+// (BinaryPacketRecord's, in the order of the channels, each queue from its head), and a CheckpointRate for each evicted
+// channel whose weight is not 1. The connection table (in the format of binary_trace.h) comes last.
+// Every record is at an offset that is a multiple of 8, so the file is just mapped and read in place (see
+// CheckpointReader). Virtual times and rates are stored as their 64 bits (a double or a uint64_t, see VirtualClock),
+// so they are restored exactly. Numbers are stored in the machine's byte order.
+
+inline constexpr char checkpoint_magic[4] = { 'W', 'F', 'Q', 'C' };
+inline constexpr uint32_t checkpoint_version = 1;
+
+// The header of a checkpoint file.
+struct CheckpointHeader {
+    // The flags of the options that the state depends on, which must be the same when it is resumed.
+    static constexpr uint32_t unweighted = 1;
+    static constexpr uint32_t fixed_point = 2;
+    static constexpr uint32_t binary_input = 4;
+    static constexpr uint32_t immediate_weights = 8;
+    static constexpr uint32_t evict_idle_channels = 16;
+    static constexpr uint32_t drop_longest = 32;
+    // A flag that is set if next_packet holds a packet that was read from the input, but not added to its channel yet.
+    static constexpr uint32_t has_next_packet = 64;
+
+    char magic[4] = {};
+    uint32_t version = 0;
+    uint32_t flags = 0;
+    // The number of entries in the connection table.
+    uint32_t num_connections = 0;
+    // The queue limits (see WfqLimits).
+    uint64_t max_channel_packets = 0;
+    uint64_t max_packets = 0;
+    // Where to continue: the offset of the rest of the input (see InputReader::offset), and the size of the output
+    // so far (see OutputWriter::position).
+    uint64_t input_offset = 0;
+    uint64_t output_position = 0;
+    // The time of the link in the driver's loop, and the arrival time of the last packet added to the scheduler.
+    uint64_t time = 0;
+    uint64_t last_arrival_time = 0;
+    // The state of the scheduler's link (see WfqScheduler::restore_link), with the virtual time's 64 bits.
+    uint64_t link_free_time = 0;
+    uint64_t virtual_time = 0;
+    uint64_t dropped_packets = 0;
+    uint64_t dropped_bytes = 0;
+    // The number of packets read from the input.
+    uint64_t packets_read = 0;
+    // The number of records of each kind.
+    uint64_t num_channels = 0;
+    uint64_t num_packets = 0;
+    uint64_t num_evicted_rates = 0;
+    BinaryPacketRecord next_packet;
+};
+static_assert(sizeof(CheckpointHeader) == 160);
+
+// A channel in memory (see WfqScheduler::SavedChannel), with the virtual times' and the rate's 64 bits.
+struct CheckpointChannel {
+    uint32_t id = 0;
+    uint32_t num_packets = 0;
+    uint64_t rate = 0;
+    uint64_t last_finish_time = 0;
+    uint64_t head_start_time = 0;
+};
+static_assert(sizeof(CheckpointChannel) == 32);
+
+// The rate of an evicted channel.
+struct CheckpointRate {
+    uint32_t channel = 0;
+    uint32_t padding = 0;
+    uint64_t rate = 0;
+};
+static_assert(sizeof(CheckpointRate) == 16);
+
+// Returns the 64 bits of a virtual time or a rate, for a checkpoint.
+template <class T>
+uint64_t checkpoint_bits(T value) {
+    static_assert(sizeof(T) == sizeof(uint64_t));
+    return std::bit_cast<uint64_t>(value);
+}
+
+// Returns a virtual time or a rate from its 64 bits in a checkpoint.
+template <class T>
+T from_checkpoint_bits(uint64_t bits) {
+    return std::bit_cast<T>(bits);
+}
+
+// The contents of a checkpoint, to be written with write_checkpoint.
+struct Checkpoint {
+    CheckpointHeader header;
+    std::vector<CheckpointChannel> channels;
+    std::vector<BinaryPacketRecord> packets;
+    std::vector<CheckpointRate> evicted_rates;
+};
+
+// Writes a checkpoint to a file, replacing it atomically: the checkpoint is written to path + ".tmp", which is then
+// renamed, so a run that stops while writing a checkpoint still leaves the previous one.
+// Sets the header's magic, version and counts. Returns false if the file can't be written.
+inline bool write_checkpoint(const std::string& path, Checkpoint& checkpoint,
+    const std::vector<std::string_view>& connections) {
+    CheckpointHeader& header = checkpoint.header;
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.num_connections = static_cast<uint32_t>(connections.size());
+    header.num_channels = checkpoint.channels.size();
+    header.num_packets = checkpoint.packets.size();
+    header.num_evicted_rates = checkpoint.evicted_rates.size();
+
+    std::string temporary = path + ".tmp";
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) return false;
+    std::fwrite(&header, sizeof(header), 1, file);
+    std::fwrite(checkpoint.channels.data(), sizeof(CheckpointChannel), checkpoint.channels.size(), file);
+    std::fwrite(checkpoint.packets.data(), sizeof(BinaryPacketRecord), checkpoint.packets.size(), file);
+    std::fwrite(checkpoint.evicted_rates.data(), sizeof(CheckpointRate), checkpoint.evicted_rates.size(), file);
+    for (std::string_view connection : connections) {
+        uint32_t length = static_cast<uint32_t>(connection.size());
+        std::fwrite(&length, sizeof(length), 1, file);
+        std::fwrite(connection.data(), 1, connection.size(), file);
+    }
+    bool ok = std::ferror(file) == 0;
+    ok &= std::fclose(file) == 0;
+    std::error_code error;
+    if (ok) std::filesystem::rename(temporary, path, error);
+    return ok && !error;
+}
+
+// Reads a checkpoint file, which is memory-mapped where possible (and otherwise read into memory), so the records
+// are read in place.
+class CheckpointReader {
+public:
+    CheckpointReader() = default;
+    CheckpointReader(const CheckpointReader&) = delete;
+    CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+    ~CheckpointReader() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping_ != nullptr) munmap(mapping_, size_);
+#endif
+    }
+
+    // Opens a checkpoint file. Returns false if it can't be read, or if it is not a valid checkpoint.
+    bool open(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                mapping_ = mapping;
+                size_ = static_cast<size_t>(st.st_size);
+                data_ = static_cast<const char*>(mapping);
+            }
+        }
+        close(fd);
+#endif
+        if (data_ == nullptr) {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (file == nullptr) return false;
+            char block[1 << 16];
+            size_t num_read;
+            while ((num_read = std::fread(block, 1, sizeof(block), file)) != 0) {
+                buffer_.insert(buffer_.end(), block, block + num_read);
+            }
+            std::fclose(file);
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+        }
+        return parse();
+    }
+
+    const CheckpointHeader& header() const {
+        return header_;
+    }
+
+    CheckpointChannel channel(size_t index) const {
+        return record<CheckpointChannel>(channels_, index);
+    }
+
+    BinaryPacketRecord packet(size_t index) const {
+        return record<BinaryPacketRecord>(packets_, index);
+    }
+
+    CheckpointRate evicted_rate(size_t index) const {
+        return record<CheckpointRate>(evicted_rates_, index);
+    }
+
+    // The connection of each channel id, as views into the file.
+    const std::vector<std::string_view>& connections() const {
+        return connections_;
+    }
+
+private:
+    // Reads the header and the connection table, and checks that the records fit in the file.
+    bool parse() {
+        if (size_ < sizeof(header_)) return false;
+        std::memcpy(&header_, data_, sizeof(header_));
+        if (std::memcmp(header_.magic, checkpoint_magic, sizeof(header_.magic)) != 0) return false;
+        if (header_.version != checkpoint_version) return false;
+        uint64_t offset = sizeof(header_);
+        auto take = [&](uint64_t count, size_t record_size, uint64_t& start) {
+            start = offset;
+            if (count > (size_ - offset) / record_size) return false;
+            offset += count * record_size;
+            return true;
+        };
+        if (!take(header_.num_channels, sizeof(CheckpointChannel), channels_)) return false;
+        if (!take(header_.num_packets, sizeof(BinaryPacketRecord), packets_)) return false;
+        if (!take(header_.num_evicted_rates, sizeof(CheckpointRate), evicted_rates_)) return false;
+        connections_.reserve(header_.num_connections);
+        for (uint32_t i = 0; i < header_.num_connections; i++) {
+            uint32_t length;
+            if (size_ - offset < sizeof(length)) return false;
+            std::memcpy(&length, data_ + offset, sizeof(length));
+            offset += sizeof(length);
+            if (size_ - offset < length) return false;
+            connections_.emplace_back(data_ + offset, length);
+            offset += length;
+        }
+        return true;
+    }
+
+    template <class T>
+    T record(uint64_t start, size_t index) const {
+        T result;
+        std::memcpy(&result, data_ + start + index * sizeof(T), sizeof(T));
+        return result;
+    }
+
+    // The file's contents: a mapping, or buffer_.
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    void* mapping_ = nullptr;
+    std::vector<char> buffer_;
+    CheckpointHeader header_;
+    // The offsets of the arrays of records.
+    uint64_t channels_ = 0;
+    uint64_t packets_ = 0;
+    uint64_t evicted_rates_ = 0;
+    std::vector<std::string_view> connections_;
+};
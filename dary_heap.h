@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+// Returns true if adding count entries to a heap of size entries (with arity children per node) is cheaper by
+// rebuilding the heap from all the entries, which is O(size + count), than by pushing them one at a time, which is
+// O(count log(size + count)) when the new entries are among the largest, as in WFQ, where a channel that becomes active
+// has one of the earliest finish times.
+inline bool rebuild_heap_is_cheaper(size_t size, size_t count, size_t arity = 2) {
+    size_t levels = 0;
+    for (size_t n = size + count; n > 1; n /= arity) levels++;
+    return count * levels > 2 * (size + count);
+}
+
+// An implicit d-ary heap, stored in a single array.
+// A 4-ary or 8-ary heap is shallower than a binary heap, and the children of a node are adjacent in memory,
+// so each level of a pop() compares entries from one or two cache lines.
+//
+// DaryHeap is a drop-in replacement for std::priority_queue<Entry>, with the same interface (push, top, pop, empty, size)
+// and the same order: Entry::operator< is used like in std::priority_queue, so top() is the largest entry.
+// As long as operator< is a strict total order (as it is for ActiveChannelEntry, which breaks ties by index),
+// the entries are popped in exactly the same order as from std::priority_queue.
+template <class Entry, size_t Arity = 4>
+class DaryHeap {
+public:
+    static_assert(Arity >= 2, "a heap needs at least 2 children per node");
+
+    bool empty() const {
+        return entries_.empty();
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+    const Entry& top() const {
+        assert(!empty());
+        return entries_.front();
+    }
+
+    void push(const Entry& entry) {
+        // Move the entry up from a new leaf, shifting smaller parents down.
+        size_t hole = entries_.size();
+        entries_.push_back(entry);
+        while (hole > 0) {
+            size_t parent = (hole - 1) / Arity;
+            if (!(entries_[parent] < entry)) break;
+            entries_[hole] = std::move(entries_[parent]);
+            hole = parent;
+        }
+        entries_[hole] = entry;
+    }
+
+    // Adds the entries [first, last), like push() for each of them. When many entries are added at once (see
+    // rebuild_heap_is_cheaper), they are appended, and the heap is rebuilt bottom-up instead.
+    template <class Iterator>
+    void push_range(Iterator first, Iterator last) {
+        size_t count = static_cast<size_t>(std::distance(first, last));
+        if (!rebuild_heap_is_cheaper(entries_.size(), count, Arity)) {
+            for (; first != last; ++first) push(*first);
+            return;
+        }
+        entries_.insert(entries_.end(), first, last);
+        // Move each parent down, from the last one to the root.
+        for (size_t parent = (entries_.size() - 2) / Arity + 1; parent-- > 0;) sift_down(parent);
+    }
+
+    void pop() {
+        assert(!empty());
+        Entry last = std::move(entries_.back());
+        entries_.pop_back();
+        if (entries_.empty()) return;
+        entries_.front() = std::move(last);
+        sift_down(0);
+    }
+
+private:
+    // Moves the entry at hole down, shifting larger children up.
+    void sift_down(size_t hole) {
+        Entry entry = std::move(entries_[hole]);
+        size_t size = entries_.size();
+        while (true) {
+            size_t first_child = hole * Arity + 1;
+            if (first_child >= size) break;
+            size_t last_child = first_child + Arity < size ? first_child + Arity : size;
+            size_t best = first_child;
+            for (size_t child = first_child + 1; child < last_child; child++) {
+                if (entries_[best] < entries_[child]) best = child;
+            }
+            if (!(entry < entries_[best])) break;
+            entries_[hole] = std::move(entries_[best]);
+            hole = best;
+        }
+        entries_[hole] = std::move(entry);
+    }
+
+    std::vector<Entry> entries_;
+};
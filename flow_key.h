@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+// Binary keys for connections (source ip, source port, destination ip, destination port).
+//
+// A key is only created for connections written in canonical form: IPv4 addresses in dotted decimal without leading zeros,
+// IPv6 addresses in the recommended text form of RFC 5952 (lowercase, no leading zeros, "::" for the longest run of zeros),
+// and ports in decimal without leading zeros. That way, two connection strings have the same key if and only if
+// they are the same string, so keyed lookup finds exactly the same channels as looking up the strings themselves.
+// Connections in any other form don't get a key, and have to be looked up by their text.
+
+// A packed key for a connection between two IPv4 addresses: 12 bytes.
+struct Ipv4FlowKey {
+    // Source address, source port, destination address, destination port (in host byte order).
+    uint8_t bytes[12] = {};
+
+    bool operator==(const Ipv4FlowKey&) const = default;
+
+    size_t hash() const {
+        uint64_t low;
+        uint32_t high;
+        std::memcpy(&low, bytes, 8);
+        std::memcpy(&high, bytes + 8, 4);
+        return mix_hash(low ^ (static_cast<uint64_t>(high) * 0x9e3779b97f4a7c15ull));
+    }
+
+    // A 64-bit finalizer (from MurmurHash3), which spreads the key's bits over the whole hash.
+    static size_t mix_hash(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+};
+
+// A packed key for a connection between two IPv6 addresses: 36 bytes.
+struct Ipv6FlowKey {
+    // Source address, source port, destination address, destination port
+    // (the addresses in network byte order, the ports in host byte order).
+    uint8_t bytes[36] = {};
+
+    bool operator==(const Ipv6FlowKey&) const = default;
+
+    size_t hash() const {
+        uint64_t h = 0;
+        for (size_t i = 0; i < 32; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+        }
+        uint32_t tail;
+        std::memcpy(&tail, bytes + 32, 4);
+        return Ipv4FlowKey::mix_hash(h ^ tail);
+    }
+};
+
+namespace flow_key_detail {
+
+// Parses a decimal number in canonical form (no sign, no leading zeros) that is at most max_value.
+inline std::optional<uint32_t> parse_decimal(std::string_view text, uint32_t max_value) {
+    if (text.empty() || text.size() > 10 || (text.size() > 1 && text[0] == '0')) return std::nullopt;
+    uint64_t value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return std::nullopt;
+        value = value * 10 + static_cast<uint64_t>(c - '0');
+    }
+    if (value > max_value) return std::nullopt;
+    return static_cast<uint32_t>(value);
+}
+
+// Parses an IPv4 address in dotted decimal form.
+inline std::optional<uint32_t> parse_ipv4(std::string_view text) {
+    uint32_t address = 0;
+    for (int i = 0; i < 4; i++) {
+        size_t dot = i < 3 ? text.find('.') : text.size();
+        if (dot == std::string_view::npos) return std::nullopt;
+        std::optional<uint32_t> octet = parse_decimal(text.substr(0, dot), 255);
+        if (!octet.has_value()) return std::nullopt;
+        address = (address << 8) | *octet;
+        text.remove_prefix(i < 3 ? dot + 1 : dot);
+    }
+    return address;
+}
+
+// Parses an IPv6 address in the canonical form of RFC 5952 into 16 bytes (in network byte order).
+inline bool parse_ipv6(std::string_view text, uint8_t* out) {
+    uint16_t groups[8] = {};
+    int num_groups = 0;
+    // The index of the group where "::" appeared, or -1.
+    int gap = -1;
+    size_t pos = 0;
+    if (text.starts_with("::")) {
+        gap = 0;
+        pos = 2;
+    }
+    while (pos < text.size()) {
+        if (num_groups == 8) return false;
+        size_t end = pos;
+        uint32_t value = 0;
+        while (end < text.size() && end - pos < 4) {
+            char c = text[end];
+            if (c >= '0' && c <= '9') value = value * 16 + static_cast<uint32_t>(c - '0');
+            else if (c >= 'a' && c <= 'f') value = value * 16 + static_cast<uint32_t>(c - 'a' + 10);
+            else break;
+            end++;
+        }
+        // Each group must be non-empty and without leading zeros.
+        if (end == pos || (end - pos > 1 && text[pos] == '0')) return false;
+        groups[num_groups++] = static_cast<uint16_t>(value);
+        pos = end;
+        if (pos == text.size()) break;
+        if (text[pos] != ':') return false;
+        pos++;
+        if (pos < text.size() && text[pos] == ':') {
+            if (gap != -1) return false;
+            gap = num_groups;
+            pos++;
+        }
+        else if (pos == text.size()) {
+            // A single trailing ':'.
+            return false;
+        }
+    }
+    uint16_t address[8] = {};
+    if (gap == -1) {
+        if (num_groups != 8) return false;
+        std::memcpy(address, groups, sizeof(groups));
+    }
+    else {
+        // "::" must stand for at least two zero groups.
+        int gap_length = 8 - num_groups;
+        if (gap_length < 2) return false;
+        for (int i = 0; i < gap; i++) address[i] = groups[i];
+        for (int i = gap; i < num_groups; i++) address[i + gap_length] = groups[i];
+    }
+    // Check that "::" is where RFC 5952 puts it: at the first of the longest runs of at least two zero groups.
+    int best_start = -1, best_length = 1;
+    for (int i = 0; i < 8;) {
+        if (address[i] != 0) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while (j < 8 && address[j] == 0) j++;
+        if (j - i > best_length) {
+            best_start = i;
+            best_length = j - i;
+        }
+        i = j;
+    }
+    if (best_start != gap || (gap != -1 && best_length != 8 - num_groups)) return false;
+    for (int i = 0; i < 8; i++) {
+        out[2 * i] = static_cast<uint8_t>(address[i] >> 8);
+        out[2 * i + 1] = static_cast<uint8_t>(address[i]);
+    }
+    return true;
+}
+
+// Splits a connection string "sadd sport dadd dport" into its 4 fields.
+inline bool split_connection(std::string_view connection, std::string_view (&fields)[4]) {
+    for (int i = 0; i < 3; i++) {
+        size_t space = connection.find(' ');
+        if (space == std::string_view::npos) return false;
+        fields[i] = connection.substr(0, space);
+        connection.remove_prefix(space + 1);
+    }
+    fields[3] = connection;
+    return connection.find(' ') == std::string_view::npos;
+}
+
+}  // namespace flow_key_detail
+
+// A connection's key: an IPv4 key, an IPv6 key, or neither.
+struct FlowKey {
+    std::optional<Ipv4FlowKey> ipv4;
+    std::optional<Ipv6FlowKey> ipv6;
+
+    // Parses a connection string "sadd sport dadd dport" (with single spaces, as returned by parse_packet_line).
+    static FlowKey parse(std::string_view connection) {
+        using namespace flow_key_detail;
+        FlowKey result;
+        std::string_view fields[4];
+        if (!split_connection(connection, fields)) return result;
+        std::optional<uint32_t> source_port = parse_decimal(fields[1], 65535);
+        std::optional<uint32_t> destination_port = parse_decimal(fields[3], 65535);
+        if (!source_port.has_value() || !destination_port.has_value()) return result;
+        if (fields[0].find(':') == std::string_view::npos) {
+            std::optional<uint32_t> source = parse_ipv4(fields[0]);
+            std::optional<uint32_t> destination = parse_ipv4(fields[2]);
+            if (!source.has_value() || !destination.has_value()) return result;
+            Ipv4FlowKey key;
+            uint16_t ports[2] = { static_cast<uint16_t>(*source_port), static_cast<uint16_t>(*destination_port) };
+            std::memcpy(key.bytes, &*source, 4);
+            std::memcpy(key.bytes + 4, &ports[0], 2);
+            std::memcpy(key.bytes + 6, &*destination, 4);
+            std::memcpy(key.bytes + 10, &ports[1], 2);
+            result.ipv4 = key;
+        }
+        else {
+            Ipv6FlowKey key;
+            if (!parse_ipv6(fields[0], key.bytes) || !parse_ipv6(fields[2], key.bytes + 18)) return result;
+            uint16_t ports[2] = { static_cast<uint16_t>(*source_port), static_cast<uint16_t>(*destination_port) };
+            std::memcpy(key.bytes + 16, &ports[0], 2);
+            std::memcpy(key.bytes + 34, &ports[1], 2);
+            result.ipv6 = key;
+        }
+        return result;
+    }
+};
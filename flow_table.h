@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A hash table that maps flow keys (see flow_key.h) to channel ids.
+// It uses open addressing with linear probing over a single array of {key, id} slots,
+// so a lookup usually touches a single cache line, instead of chasing the nodes of a std::unordered_map.
+// Entries are never removed.
+//
+// Key must be trivially copyable, and have operator== and a hash() method.
+template <class Key>
+class FlowTable {
+public:
+    // The id of an empty slot.
+    static constexpr uint32_t no_id = UINT32_MAX;
+
+    FlowTable() : slots_(initial_capacity) {}
+
+    // Returns the id of the given key.
+    // If the key is not in the table, it is added with new_id, and the second element of the result is true.
+    std::pair<uint32_t, bool> find_or_insert(const Key& key, uint32_t new_id) {
+        size_t mask = slots_.size() - 1;
+        for (size_t i = key.hash() & mask;; i = (i + 1) & mask) {
+            Slot& slot = slots_[i];
+            if (slot.id == no_id) {
+                slot.key = key;
+                slot.id = new_id;
+                // Keep the load factor at most 1/2, so probe sequences stay short.
+                if (++size_ * 2 > slots_.size()) grow();
+                return { new_id, true };
+            }
+            if (slot.key == key) return { slot.id, false };
+        }
+    }
+
+    // Returns the number of keys in the table.
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    static constexpr size_t initial_capacity = 1024;
+
+    struct Slot {
+        Key key;
+        uint32_t id = no_id;
+    };
+
+    // Doubles the number of slots, and reinserts all the keys.
+    void grow() {
+        std::vector<Slot> old_slots(slots_.size() * 2);
+        old_slots.swap(slots_);
+        size_t mask = slots_.size() - 1;
+        for (const Slot& old_slot : old_slots) {
+            if (old_slot.id == no_id) continue;
+            size_t i = old_slot.key.hash() & mask;
+            while (slots_[i].id != no_id) i = (i + 1) & mask;
+            slots_[i] = old_slot;
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,131 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A program that generates synthetic input traces for wfq.exe and new_wfq.exe (for benchmarks, see bench.sh).
+// The trace is written to stdout, one packet per line: "time sadd sport dadd dport length [weight]".
+
+// The parameters of the generated trace.
+struct Options {
+    // The number of packets.
+    uint64_t packets = 1000000;
+    // The number of distinct connections.
+    uint64_t flows = 1000;
+    // The probability that a packet has an explicit weight (which changes its channel's weight).
+    double weight_rate = 0.0;
+    // The average number of packets that arrive at the same time.
+    double burst = 1.0;
+    // The average time between two groups of packets that arrive at the same time.
+    double gap = 500.0;
+    // The distribution of packet lengths: "fixed:N", "uniform:MIN-MAX", or "imix" (the simple IMIX mix of 40, 576 and 1500).
+    std::string lengths = "imix";
+    // The seed of the random number generator.
+    uint64_t seed = 1;
+};
+
+[[noreturn]] void usage(const char* program) {
+    std::cerr << "usage: " << program << " [--packets N] [--flows N] [--weight-rate P] [--burst N] [--gap N]"
+        " [--lengths fixed:N|uniform:MIN-MAX|imix] [--seed N] > trace" << std::endl;
+    std::exit(1);
+}
+
+Options parse_options(int argc, char* argv[]) {
+    Options result;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) usage(argv[0]);
+        const char* value = argv[++i];
+        if (arg == "--packets") result.packets = std::strtoull(value, nullptr, 10);
+        else if (arg == "--flows") result.flows = std::strtoull(value, nullptr, 10);
+        else if (arg == "--weight-rate") result.weight_rate = std::strtod(value, nullptr);
+        else if (arg == "--burst") result.burst = std::strtod(value, nullptr);
+        else if (arg == "--gap") result.gap = std::strtod(value, nullptr);
+        else if (arg == "--lengths") result.lengths = value;
+        else if (arg == "--seed") result.seed = std::strtoull(value, nullptr, 10);
+        else usage(argv[0]);
+    }
+    if (result.flows == 0 || result.burst < 1.0 || result.gap < 0) usage(argv[0]);
+    return result;
+}
+
+// The connection string of the i-th flow. All the flows have distinct connection strings.
+std::string connection_of(uint64_t i) {
+    static const unsigned destination_ports[] = { 80, 443, 8080 };
+    char buffer[96];
+    std::snprintf(buffer, sizeof(buffer), "10.%u.%u.%u %u 192.168.%u.%u %u",
+        static_cast<unsigned>((i >> 16) & 255), static_cast<unsigned>((i >> 8) & 255), static_cast<unsigned>(i & 255),
+        static_cast<unsigned>(1024 + (i >> 24) % 64000),
+        static_cast<unsigned>(i % 4), static_cast<unsigned>(1 + i % 250),
+        destination_ports[i % 3]);
+    return buffer;
+}
+
+int main(int argc, char* argv[]) {
+    Options options = parse_options(argc, argv);
+    std::mt19937_64 random(options.seed);
+
+    std::vector<std::string> connections;
+    connections.reserve(options.flows);
+    for (uint64_t i = 0; i < options.flows; i++) connections.push_back(connection_of(i));
+
+    // Packet lengths.
+    std::uniform_int_distribution<uint64_t> uniform_length(40, 1500);
+    uint64_t fixed_length = 0;
+    std::string_view lengths = options.lengths;
+    if (lengths.starts_with("fixed:")) {
+        fixed_length = std::strtoull(options.lengths.c_str() + 6, nullptr, 10);
+    }
+    else if (lengths.starts_with("uniform:")) {
+        char* end;
+        uint64_t min = std::strtoull(options.lengths.c_str() + 8, &end, 10);
+        uint64_t max = *end == '-' ? std::strtoull(end + 1, nullptr, 10) : min;
+        if (max < min) usage(argv[0]);
+        uniform_length = std::uniform_int_distribution<uint64_t>(min, max);
+    }
+    else if (lengths != "imix") {
+        usage(argv[0]);
+    }
+    // The simple IMIX: 7 packets of 40 bytes, 4 of 576 and 1 of 1500.
+    std::discrete_distribution<int> imix({ 7, 4, 1 });
+    static const uint64_t imix_lengths[] = { 40, 576, 1500 };
+
+    std::uniform_int_distribution<uint64_t> flow(0, options.flows - 1);
+    std::bernoulli_distribution has_weight(options.weight_rate);
+    std::uniform_int_distribution<int> weight_hundredths(10, 1000);
+    // Bursts have a geometric number of packets with the given mean, and exponential gaps between them.
+    std::geometric_distribution<uint64_t> extra_burst_packets(1.0 / options.burst);
+    std::exponential_distribution<double> gap(options.gap > 0 ? 1.0 / options.gap : 1.0);
+
+    uint64_t time = 0;
+    uint64_t left_in_burst = 1 + extra_burst_packets(random);
+    for (uint64_t i = 0; i < options.packets; i++) {
+        if (left_in_burst == 0) {
+            if (options.gap > 0) time += static_cast<uint64_t>(gap(random));
+            left_in_burst = 1 + extra_burst_packets(random);
+        }
+        left_in_burst--;
+
+        uint64_t length;
+        if (fixed_length != 0) length = fixed_length;
+        else if (lengths == "imix") length = imix_lengths[imix(random)];
+        else length = uniform_length(random);
+
+        const std::string& connection = connections[flow(random)];
+        if (has_weight(random)) {
+            int weight = weight_hundredths(random);
+            std::printf("%llu %s %llu %d.%02d\n", static_cast<unsigned long long>(time), connection.c_str(),
+                static_cast<unsigned long long>(length), weight / 100, weight % 100);
+        }
+        else {
+            std::printf("%llu %s %llu\n", static_cast<unsigned long long>(time), connection.c_str(),
+                static_cast<unsigned long long>(length));
+        }
+    }
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "phase_timer.h"
+#include "wfq_scheduler.h"
+
+// A two-level (hierarchical) WFQ scheduler for a single output link: the channels (flows) are grouped into classes
+// (for example, the tenants of the link), the link is shared between the active classes by the weights of the classes,
+// and the share of each class is shared between its active flows by the weights of the flows.
+//
+// Each class schedules its flows with its own WfqScheduler, with its own virtual time and its own priority queue of
+// its flows, and the classes are scheduled the same way one level up: a priority queue of the active classes, ordered
+// by their finish times in the link's virtual time. The finish time of a class is computed like a channel's, from the
+// length of the packet its own scheduler would send next: max(virtual time, the class's last finish time) +
+// length / the class's weight. The class may send another packet when its turn comes (one of its flows may get a
+// packet with an earlier finish time in the meantime), and the class is then charged for the packet it actually sends.
+// With a single class, the order is the same as with a flat WfqScheduler.
+//
+// Each dequeue touches the priority queue of the classes and the priority queue of one class, which are both much
+// smaller than a single queue of all the flows, when there are many flows.
+//
+// It has the interface of WfqScheduler that the driver uses (enqueue, dequeue and the sizes), and classes are added
+// with add_class(), and each channel must be put in its class with add_channel() before its first packet.
+// Like channels, classes have small integer ids, which break ties between equal finish times, so they should be given
+// in the order classes appear. The limits (see WfqLimits) apply to the schedulers of the classes, so max_packets
+// (which is global to a link) is not supported.
+template <class Payload, class Queue = std::priority_queue<ActiveChannelEntry>, class VirtualClock = DoubleVirtualClock>
+class HierarchicalWfqScheduler {
+public:
+    using Flows = WfqScheduler<Payload, Queue, VirtualClock>;
+    using Time = typename VirtualClock::Time;
+    using Rate = typename VirtualClock::Rate;
+    using Departure = typename Flows::Departure;
+    using Drop = typename Flows::Drop;
+
+    explicit HierarchicalWfqScheduler(const WfqLimits& limits = {},
+        WeightUpdate weight_update = WeightUpdate::next_packet)
+        : limits_(limits), weight_update_(weight_update) {
+        assert(limits.max_packets == 0);
+    }
+
+    // Adds a class with the given weight, and returns its id (0, 1, ...).
+    uint32_t add_class(double weight = 1.0) {
+        Class& result = classes_.emplace_back(limits_, weight_update_);
+        result.rate = VirtualClock::rate(weight);
+        return static_cast<uint32_t>(classes_.size() - 1);
+    }
+
+    // Puts a new channel in a class. Its packets are then scheduled among the class's flows.
+    void add_channel(uint32_t channel_id, uint32_t class_id) {
+        if (channel_id >= flows_.size()) flows_.resize(channel_id + 1);
+        Class& parent = classes_[class_id];
+        // In the class's scheduler, the channel has the next local id, so ties are still broken in the order of
+        // appearance.
+        flows_[channel_id] = { class_id, static_cast<uint32_t>(parent.channel_ids.size()) };
+        parent.channel_ids.push_back(channel_id);
+    }
+
+    // Returns the number of classes.
+    size_t num_classes() const {
+        return classes_.size();
+    }
+
+    // Adds a packet to the end of its channel's queue, in the channel's class (see WfqScheduler::enqueue).
+    // If a queue limit is reached, the packet is dropped and returned.
+    std::optional<Drop> enqueue(uint32_t channel_id, uint64_t length, std::optional<double> weight,
+        Payload payload = {}) {
+        auto [class_id, flow] = flows_[channel_id];
+        Class& parent = classes_[class_id];
+        size_t active_before = parent.flows.num_active_channels();
+        std::optional<Drop> drop = parent.flows.enqueue(flow, length, weight, std::move(payload));
+        if (drop.has_value()) {
+            // Without max_packets, only the arriving packet is dropped.
+            drop->channel = channel_id;
+            return drop;
+        }
+        num_packets_++;
+        num_active_channels_ += parent.flows.num_active_channels() - active_before;
+        if (!parent.active) mark_class_active(class_id);
+        return drop;
+    }
+
+    // Starts transmitting the next packet at time now, and returns it (see WfqScheduler::dequeue).
+    // Returns std::nullopt if there are no packets, or if the link is still busy at time now.
+    std::optional<Departure> dequeue(uint64_t now) {
+        if (num_packets_ == 0 || now < link_free_time_) return std::nullopt;
+        // Process the class with the highest priority.
+        virtual_time_ = std::max(virtual_time_, active_classes_.top().priority_snapshot);
+        uint32_t class_id = active_classes_.top().channel;
+        active_classes_.pop();
+        WFQ_COUNT(heap_pops);
+        Class& parent = classes_[class_id];
+        parent.active = false;
+        // The scheduler of a class has no link of its own: it sends whenever its class does.
+        size_t active_before = parent.flows.num_active_channels();
+        std::optional<Departure> departure = parent.flows.dequeue(*parent.flows.next_departure_time());
+        assert(departure.has_value());
+        num_active_channels_ -= active_before - parent.flows.num_active_channels();
+        num_packets_--;
+        // Charge the class for the packet it sent, which may not be the one its finish time was computed for.
+        parent.last_finish_time = parent.start_time + VirtualClock::duration(departure->length, parent.rate);
+        departure->channel = parent.channel_ids[departure->channel];
+        departure->start_time = now;
+        link_free_time_ = now + departure->length;
+        if (!parent.flows.empty()) mark_class_active(class_id);
+        return departure;
+    }
+
+    // Returns the payload of the packet that dequeue() would transmit next, or nullptr if there are no packets.
+    // The pointer is valid until the scheduler is changed.
+    const Payload* next_payload() {
+        if (num_packets_ == 0) return nullptr;
+        return classes_[active_classes_.top().channel].flows.next_payload();
+    }
+
+    // Returns the earliest time at which dequeue() will return a packet (which may be in the past),
+    // or std::nullopt if there are no packets.
+    std::optional<uint64_t> next_departure_time() const {
+        if (num_packets_ == 0) return std::nullopt;
+        return link_free_time_;
+    }
+
+    // Returns true if there are no packets waiting to be transmitted.
+    bool empty() const {
+        return num_packets_ == 0;
+    }
+
+    // Returns the number of packets waiting to be transmitted.
+    size_t size() const {
+        return num_packets_;
+    }
+
+    // Returns the number of active channels (in all the classes).
+    size_t num_active_channels() const {
+        return num_active_channels_;
+    }
+
+    // Returns the number of active classes.
+    size_t num_active_classes() const {
+        return active_classes_.size();
+    }
+
+    // Returns the time when the link finishes transmitting its current packet.
+    uint64_t link_free_time() const {
+        return link_free_time_;
+    }
+
+    // Returns the virtual time of the link, which is used to calculate the priority of classes.
+    Time virtual_time() const {
+        return virtual_time_;
+    }
+
+private:
+    // A class of channels.
+    struct Class {
+        // The packet pools of the classes start empty, since there may be many classes.
+        Class(const WfqLimits& limits, WeightUpdate weight_update) : flows(limits, weight_update, 0) {}
+
+        // The scheduler of the class's flows, by their local ids.
+        Flows flows;
+        // The class's weight, as a rate of the virtual clock.
+        Rate rate = VirtualClock::rate(1.0);
+        // The virtual start time and the last finish time of the class's next packet (see mark_class_active).
+        Time start_time = 0;
+        Time last_finish_time = 0;
+        // True if the class has an entry in active_classes_.
+        bool active = false;
+        // The channel id of each local id.
+        std::vector<uint32_t> channel_ids;
+    };
+
+    // The class of a channel, and the channel's id in its class's scheduler.
+    struct Flow {
+        uint32_t class_id = 0;
+        uint32_t local_id = 0;
+    };
+
+    // Adds a class that has packets to active_classes_, with the finish time of the packet it would send next.
+    void mark_class_active(uint32_t class_id) {
+        Class& parent = classes_[class_id];
+        parent.start_time = std::max(virtual_time_, parent.last_finish_time);
+        Time finish_time = parent.start_time + VirtualClock::duration(*parent.flows.next_length(), parent.rate);
+        parent.last_finish_time = finish_time;
+        parent.active = true;
+        // Classes never have stale entries, so their generation doesn't matter.
+        active_classes_.push({ class_id, 0, finish_time });
+        WFQ_COUNT(heap_pushes);
+    }
+
+    WfqLimits limits_;
+    WeightUpdate weight_update_;
+    // The virtual time of the link.
+    Time virtual_time_ = 0;
+    std::vector<Class> classes_;
+    // The class and local id of each channel id.
+    std::vector<Flow> flows_;
+    // The classes that have packets, ordered by priority.
+    Queue active_classes_;
+    // The number of packets in all the classes, and the number of active channels in all the classes.
+    size_t num_packets_ = 0;
+    size_t num_active_channels_ = 0;
+    // The time when the link finishes transmitting its current packet.
+    uint64_t link_free_time_ = 0;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "uring_io.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define WFQ_HAVE_MMAP 1
+#endif
+
+// Reads the input line by line, without going through std::cin.
+// If stdin is a regular file, it is memory-mapped, and lines are returned directly from the mapping.
+// Otherwise (for example, if stdin is a pipe), it is read in large blocks into a buffer, or, with enable_io_uring(),
+// read ahead asynchronously into the buffers of a UringReader (see uring_io.h).
+//
+// Lines are returned as spans without the '\n', and are writable, so the parser can tokenize them in place
+// (the mapping is private, so writes never reach the file).
+// A returned line stays valid until the next call to next_line().
+class InputReader {
+public:
+    // The size of each block read from stdin, when it is not memory-mapped.
+    static constexpr size_t block_size = 1 << 20;
+
+    InputReader() {
+#ifdef WFQ_HAVE_MMAP
+        struct stat st;
+        if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            // Map the whole file, starting from the current position of stdin.
+            off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            size_t size = static_cast<size_t>(st.st_size);
+            if (offset < 0 || static_cast<size_t>(offset) > size) offset = 0;
+            void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, STDIN_FILENO, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, size, MADV_SEQUENTIAL);
+                mapping_ = static_cast<char*>(mapping);
+                mapping_size_ = size;
+                pos_ = mapping_ + offset;
+                end_ = mapping_ + size;
+                end_offset_ = size;
+                return;
+            }
+        }
+        // Offsets count from the current position of stdin, if it has one (a pipe doesn't).
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (offset > 0) end_offset_ = static_cast<uint64_t>(offset);
+#endif
+        buffer_.resize(block_size);
+        pos_ = end_ = buffer_.data();
+    }
+
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    ~InputReader() {
+#ifdef WFQ_HAVE_MMAP
+        if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+#endif
+    }
+
+    // Returns the next line, or std::nullopt if there are no more lines.
+    // Like std::getline, the last line does not have to end with '\n'.
+    std::optional<std::span<char>> next_line() {
+        while (true) {
+            char* newline = static_cast<char*>(std::memchr(pos_, '\n', end_ - pos_));
+            if (newline != nullptr) {
+                std::span<char> line(pos_, newline);
+                pos_ = newline + 1;
+                return line;
+            }
+            if (mapping_ != nullptr || !refill()) {
+                // No more input: return the last line, unless it is empty.
+                if (pos_ == end_) return std::nullopt;
+                std::span<char> line(pos_, end_);
+                pos_ = end_;
+                return line;
+            }
+        }
+    }
+
+    // Returns the next size bytes of the input (or fewer, at the end of the input), for binary input (see binary_trace.h).
+    // Like a line, the bytes stay valid until the next call.
+    std::span<char> next_bytes(size_t size) {
+        while (static_cast<size_t>(end_ - pos_) < size && mapping_ == nullptr && refill()) {}
+        size_t available = std::min(size, static_cast<size_t>(end_ - pos_));
+        std::span<char> bytes(pos_, available);
+        pos_ += available;
+        return bytes;
+    }
+
+    // Returns the offset in stdin of the unread part of the input (the number of bytes before it, if stdin is a pipe).
+    uint64_t offset() const {
+        return end_offset_ - static_cast<uint64_t>(end_ - pos_);
+    }
+
+    // Skips the input up to an offset (see offset()), for resuming from a checkpoint: a memory-mapped input just moves
+    // to it, and otherwise the input up to it is read and discarded. Returns false if the input ends before the offset,
+    // or if it was already read past it.
+    bool skip_to(uint64_t target) {
+        while (offset() < target) {
+            uint64_t needed = target - offset();
+            if (needed <= static_cast<uint64_t>(end_ - pos_)) {
+                pos_ += needed;
+                break;
+            }
+            pos_ = end_;
+            if (mapping_ != nullptr || !refill()) return false;
+        }
+        return offset() == target;
+    }
+
+    // Reads the input ahead with io_uring, if it is not memory-mapped (a mapping needs no reads) and io_uring is available.
+    // Must be called before anything is read. Returns true if io_uring is used.
+    bool enable_io_uring() {
+#ifdef WFQ_HAVE_IO_URING
+        if (mapping_ != nullptr || pos_ != end_) return false;
+        auto reader = std::make_unique<UringReader>();
+        if (!reader->start(STDIN_FILENO)) return false;
+        uring_ = std::move(reader);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // If the input is memory-mapped, returns all of its unread part, which is then considered read
+    // (so it can be parsed by other means, see parallel_parser.h). The span stays valid as long as the reader.
+    // Otherwise, returns std::nullopt, and the input has to be read with next_line().
+    std::optional<std::span<char>> take_mapped_input() {
+        if (mapping_ == nullptr) return std::nullopt;
+        std::span<char> rest(pos_, end_);
+        pos_ = end_;
+        return rest;
+    }
+
+private:
+    // Reads another block from stdin into the buffer, keeping the unused part of the buffer.
+    // Returns false if there is no more input.
+    bool refill() {
+        if (eof_) return false;
+#ifdef WFQ_HAVE_IO_URING
+        if (uring_ != nullptr) {
+            // The unread part is copied in front of the next block, and the current block stays valid at the end.
+            size_t kept = end_ - pos_;
+            std::optional<std::span<char>> block = uring_->next_block(std::span<const char>(pos_, kept));
+            if (!block.has_value()) {
+                eof_ = true;
+                return false;
+            }
+            end_offset_ += block->size() - kept;
+            pos_ = block->data();
+            end_ = block->data() + block->size();
+            return true;
+        }
+#endif
+        // Move the partial line to the start of the buffer, and grow the buffer if the line fills it.
+        size_t kept = end_ - pos_;
+        std::memmove(buffer_.data(), pos_, kept);
+        if (buffer_.size() - kept < block_size) buffer_.resize(kept + block_size);
+        size_t num_read = read_some(buffer_.data() + kept, buffer_.size() - kept);
+        if (num_read == 0) eof_ = true;
+        end_offset_ += num_read;
+        pos_ = buffer_.data();
+        end_ = buffer_.data() + kept + num_read;
+        return num_read != 0;
+    }
+
+    // Reads up to size bytes from stdin. Returns 0 at the end of the input.
+    // On POSIX this returns as soon as some input is available, so a slow pipe is not held back by the block size.
+    static size_t read_some(char* data, size_t size) {
+#ifdef WFQ_HAVE_MMAP
+        while (true) {
+            ssize_t result = read(STDIN_FILENO, data, size);
+            if (result >= 0) return static_cast<size_t>(result);
+            if (errno != EINTR) return 0;
+        }
+#else
+        return std::fread(data, 1, size, stdin);
+#endif
+    }
+
+    // The memory-mapped input, or nullptr if the input is read into buffer_.
+    char* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    // The buffer used when the input is not memory-mapped.
+    std::vector<char> buffer_;
+    // The unread part of the input (in the mapping or in the buffer).
+    char* pos_ = nullptr;
+    char* end_ = nullptr;
+    // The offset in stdin of end_ (see offset()).
+    uint64_t end_offset_ = 0;
+    // True if fread reached the end of stdin.
+    bool eof_ = false;
+#ifdef WFQ_HAVE_IO_URING
+    // The reader of the input, with enable_io_uring().
+    std::unique_ptr<UringReader> uring_;
+#endif
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+
+// A histogram of uint64_t values with logarithmic buckets, like an HDR histogram: each power of two is split into
+// 2^SubBucketBits buckets of equal width, so every value is recorded with a relative error of at most 2^-SubBucketBits
+// (values below 2^SubBucketBits are exact). It covers the whole range of uint64_t in a fixed-size array,
+// so recording a value never allocates, and is just a few bit operations and an increment.
+//
+// Count is the type of the counts of the buckets: a smaller type makes the histogram smaller, when there are many
+// histograms (such as one per channel), as long as no bucket reaches its maximum.
+template <class Count, int SubBucketBits>
+class LogHistogram {
+public:
+    static_assert(SubBucketBits >= 0 && SubBucketBits < 16);
+
+    static constexpr int sub_buckets = 1 << SubBucketBits;
+    // The values below sub_buckets have a bucket each, and each power of two above has sub_buckets buckets.
+    static constexpr int num_buckets = (64 - SubBucketBits + 1) * sub_buckets;
+
+    // Adds count occurrences of value.
+    void record(uint64_t value, uint64_t count = 1) {
+        counts_[bucket_of(value)] += static_cast<Count>(count);
+        total_ += count;
+        sum_ += value * count;
+        max_ = std::max(max_, value);
+    }
+
+    // Adds all the values of another histogram.
+    template <class OtherCount>
+    void add(const LogHistogram<OtherCount, SubBucketBits>& other) {
+        for (int i = 0; i < num_buckets; i++) counts_[i] += static_cast<Count>(other.counts_[i]);
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    // The number of values recorded.
+    uint64_t total() const {
+        return total_;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    double mean() const {
+        return total_ == 0 ? 0.0 : static_cast<double>(sum_) / static_cast<double>(total_);
+    }
+
+    // Returns the value below which (or at which) the given fraction of the values are, rounded up to the largest
+    // value of its bucket (but not above the maximum). Returns 0 if the histogram is empty.
+    uint64_t quantile(double fraction) const {
+        if (total_ == 0) return 0;
+        // The rank of the value, from 1 to total_.
+        uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total_));
+        rank = std::clamp<uint64_t>(rank, 1, total_);
+        uint64_t seen = 0;
+        for (int i = 0; i < num_buckets; i++) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(last_value_of(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    template <class, int>
+    friend class LogHistogram;
+
+    static int bucket_of(uint64_t value) {
+        if (value < sub_buckets) return static_cast<int>(value);
+        // The position of the highest bit, which is at least SubBucketBits.
+        int exponent = 63 - std::countl_zero(value);
+        // The next SubBucketBits bits below the highest bit choose the bucket within the power of two.
+        int sub_bucket = static_cast<int>(value >> (exponent - SubBucketBits)) - sub_buckets;
+        return (exponent - SubBucketBits + 1) * sub_buckets + sub_bucket;
+    }
+
+    // Returns the largest value that goes to a bucket.
+    static uint64_t last_value_of(int bucket) {
+        if (bucket < sub_buckets) return static_cast<uint64_t>(bucket);
+        int exponent = bucket / sub_buckets - 1 + SubBucketBits;
+        uint64_t first = static_cast<uint64_t>(sub_buckets + bucket % sub_buckets) << (exponent - SubBucketBits);
+        uint64_t width = uint64_t(1) << (exponent - SubBucketBits);
+        return first + (width - 1);
+    }
+
+    Count counts_[num_buckets] = {};
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
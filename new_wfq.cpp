@@ -5,13 +5,24 @@
 #include <sstream>
 #include <optional>
 #include <vector>
+#include <deque>
 #include <queue>
 #include <compare>
 #include <unordered_map>
-#include <format>
 #include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <string_view>
 
-// Information about a packet: index, arrival time, connection, length, and weight.
+#include "input_reader.h"
+#include "output_writer.h"
+#include "packet_parser.h"
+#include "phase_timer.h"
+
+// Information about a packet: arrival time, length, and weight.
+// A packet doesn't keep its connection: it is written with the connection of its channel (see ChannelInfo),
+// so queueing and transmitting a packet never copies a string.
 //
 // PacketInfo also implements the comparison operators (==, !=, <, >, <=, >=), and they all compare by priority.
 // This means, for example, that you can call std::max() on PacketInfo's,
@@ -20,8 +31,6 @@ class PacketInfo {
 public:
 	// The time when the packet arrived.
 	uint64_t time = 0;
-	// The packet's connection (source IP, source port, destination IP, destination port).
-	std::string connection = "";
 	// The packet's length.
 	uint64_t length = 0;
 	// The packet's weight.
@@ -29,19 +38,17 @@ public:
 	// This field is true if the packet was received with the weight written explicitly.
 	bool has_explicit_weight = false;
 
-	// Implementation of printing for PacketInfo.
-	friend std::ostream& operator<<(std::ostream& os, const PacketInfo& self) {
-		if (self.has_explicit_weight) {
-			return os << std::format("{} {} {} {:.2f}", self.time, self.connection, self.length, self.weight);
-		}
-		else {
-			return os << self.time << " " << self.connection << " " << self.length;
-		}
+	// Writes the packet to the output, as transmitted at the given time.
+	// connection is the connection of the packet's channel.
+	void write(OutputWriter& writer, uint64_t transmit_time, std::string_view connection) const {
+		writer.write_packet(transmit_time, time, connection, length,
+			has_explicit_weight ? std::optional<double>(weight) : std::nullopt);
 	}
 };
 
 // An object that contains information about a channel.
 // A channel is defined by its index, weight, connection, and a queue of packets that are waiting to be transmitted on this channel.
+// A channel is active if its queue is not empty.
 class ChannelInfo {
 public:
 	// The channel's index in the input.
@@ -49,87 +56,163 @@ public:
 	// The channel's weight.
 	double weight = 1.0;
 	// The channel's connection (source IP, source port, destination IP, destination port).
-	std::string connection = "";
+	// This is a view into the channel's key in channelsIndexMap, which never moves.
+	std::string_view connection;
 	// A queue of packets that are waiting to be transmitted on this channel.
 	std::queue<PacketInfo> Q = {};
+	// Incremented whenever the channel's priority changes, so that older entries in active_channels can be recognized as stale.
+	uint64_t generation = 0;
 };
 
-std::unordered_map<std::string, uint64_t> channelsIndexMap;
-std::unordered_map<std::string, ChannelInfo*>  channelsMap;
-std::list<ChannelInfo> channels;
-std::optional<PacketInfo> next_packet;
-
-// Reads a PacketInfo from an input string.
-// Also assigns it a weight according to connection_weights, or updates connection_weight, as required.
-PacketInfo parse_packet(const char* input_line) {
-	PacketInfo result;
-	char sadd[32], sport[32], dadd[32], dport[32];
-	int num_read = sscanf(
-		input_line,
-		"%llu %31s %31s %31s %31s %llu %lf",
-		&result.time, sadd, sport, dadd, dport, &result.length, &result.weight
-	);
-	result.connection = std::format("{} {} {} {}", sadd, sport, dadd, dport);
-	if (num_read == 6) {
-		result.has_explicit_weight = false;
+// Maps connection strings to channel indices.
+std::unordered_map<std::string, uint64_t, ConnectionHash, std::equal_to<>> channelsIndexMap;
+// All the channels, by index.
+// Channels are never removed: when a channel's queue becomes empty, it just becomes inactive.
+// This is a deque so that adding a channel never moves the others (with a vector, growing it would copy every channel's
+// queue, since std::queue can't be moved without the possibility of an exception).
+std::deque<ChannelInfo> channels;
+
+// A packet that has been read from the input, but not yet added to its channel.
+struct InputPacket {
+	PacketInfo packet;
+	// The packet's connection: a view into its input line, which stays valid until the next line is read.
+	std::string_view connection;
+};
+std::optional<InputPacket> next_packet;
+// The reader for stdin.
+InputReader input;
+// The writer for stdout.
+OutputWriter output;
+
+// An entry in active_channels: a channel, and its priority when the entry was added.
+struct ActiveChannelEntry {
+	// The channel's priority: the length of its first packet divided by its weight.
+	double priority;
+	// The channel's index.
+	uint64_t index;
+	// The channel's generation when the entry was added. If the channel's generation has changed since then, the entry is stale.
+	uint64_t generation;
+
+	// Compares the priority of two channels: the channel with the smaller priority (and then the smaller index) comes first.
+	bool operator<(const ActiveChannelEntry& other) const {
+		if (priority != other.priority)
+			return priority > other.priority;
+		return index > other.index;
 	}
-	else if (num_read == 7) {
-		result.has_explicit_weight = true;
+};
+// The active channels, ordered by priority.
+// Each active channel has exactly one entry which is not stale; stale entries are skipped when they reach the top.
+std::priority_queue<ActiveChannelEntry> active_channels;
+
+// Returns true if an entry in active_channels is stale.
+bool is_stale(const ActiveChannelEntry& entry) {
+	return entry.generation != channels[entry.index].generation;
+}
+
+// Removes stale entries from the top of active_channels.
+void skip_stale_entries() {
+	while (!active_channels.empty() && is_stale(active_channels.top())) {
+		active_channels.pop();
+		WFQ_COUNT(heap_pops);
 	}
-	else {
+}
+
+// Rebuilds active_channels from the active channels, dropping all the stale entries.
+void compact_active_channels() {
+	std::vector<ActiveChannelEntry> entries;
+	for (const ChannelInfo& channel : channels) {
+		if (!channel.Q.empty()) {
+			entries.push_back({ channel.Q.front().length / channel.weight, channel.index, channel.generation });
+		}
+	}
+	active_channels = std::priority_queue<ActiveChannelEntry>(std::less<ActiveChannelEntry>(), std::move(entries));
+}
+
+// Adds an entry with the channel's current priority to active_channels (the channel's queue must not be empty).
+// The channel's previous entry, if any, becomes stale.
+void update_channel_priority(ChannelInfo& channel) {
+	channel.generation++;
+	active_channels.push({ channel.Q.front().length / channel.weight, channel.index, channel.generation });
+	WFQ_COUNT(heap_pushes);
+	WFQ_COUNT_PEAK(active_channels, active_channels.size());
+	// Stale entries of active channels may stay deep in the heap for a long time, so drop them once there are too many.
+	if (active_channels.size() > 2 * channels.size() + 1024) {
+		compact_active_channels();
+	}
+}
+
+// Reads a packet from an input line. The line may be modified in place (see parse_packet_line),
+// and the packet's connection is a view into it.
+InputPacket parse_packet(std::span<char> input_line) {
+	std::string_view original_line(input_line.data(), input_line.size());
+	std::optional<PacketLine> parsed = parse_packet_line(input_line);
+	if (!parsed.has_value()) {
 		// If the input line did not contain exactly 6 or 7 parameters, that's an error.
-		std::cerr << "bad input line: " << input_line << std::endl;
+		output.flush();
+		std::cerr << "bad input line: " << original_line << std::endl;
 		std::abort();
 	}
+	InputPacket result;
+	result.packet.time = parsed->time;
+	result.packet.length = parsed->length;
+	if (parsed->weight.has_value()) {
+		result.packet.weight = *parsed->weight;
+		result.packet.has_explicit_weight = true;
+	}
+	result.connection = parsed->connection;
 	return result;
 }
 
+// Parses the next input line into next_packet, unless it already holds a packet that was read ahead.
+// Returns false at the end of the input.
+bool peek_packet() {
+	if (next_packet.has_value()) return true;
+	WFQ_PHASE(parse);
+	std::optional<std::span<char>> line = input.next_line();
+	if (!line.has_value()) return false;
+	next_packet = parse_packet(*line);
+	WFQ_COUNT_PACKET();
+	return true;
+}
+
 // Reads a batch of PacketInfo's from stdin.
 // A batch is defined as a sequence of packets with the same arrival time.
 // Does not read packets whose arrival time is greater than max_time.
 // Adds all the PacketInfo's read into channels.
 // Returns the number of PacketInfo's read, which may be 0.
 size_t read_batch_with_timeout(uint64_t max_time) {
-	std::string line;
 	size_t num_read;
 	for (num_read = 0;; num_read++) {
-		if (!next_packet.has_value()) {
-			if (!std::getline(std::cin, line)) break;
-			next_packet = parse_packet(line.c_str());
-		}
-		if (next_packet->time > max_time) break;
-		max_time = std::min(max_time, next_packet->time);
+		if (!peek_packet()) break;
+		const PacketInfo& packet = next_packet->packet;
+		if (packet.time > max_time) break;
+		max_time = std::min(max_time, packet.time);
 		// Find the channel for this packet, or create a new one if it doesn't exist.
-		auto iter = channelsMap.find(next_packet->connection);
-		if (iter == channelsMap.end()) {
-			// If the channel does not exist, create a new one.
-			ChannelInfo new_channel = ChannelInfo();
-			auto index_iter = channelsIndexMap.find(next_packet->connection);
-			if (index_iter != channelsIndexMap.end()) {
-				new_channel.index = index_iter->second;
-			}
-			else {
-				new_channel.index = channelsIndexMap.size(); // Assign a new index.
-				channelsIndexMap[next_packet->connection] = new_channel.index;
-			}
-			new_channel.connection = next_packet->connection;
-			if (next_packet->has_explicit_weight) {
-				new_channel.weight = next_packet->weight;
-			}
-			else {
-				new_channel.weight = 1.0; // Default weight if not specified.
-			}
-			new_channel.Q.push(*next_packet);
-			channels.push_back(new_channel);
-			channelsMap[next_packet->connection] = &channels.back();
+		WFQ_PHASE(lookup);
+		auto index_iter = channelsIndexMap.find(next_packet->connection);
+		if (index_iter == channelsIndexMap.end()) {
+			// Assign a new index. This is the only copy of the connection string.
+			index_iter = channelsIndexMap.emplace(next_packet->connection, channels.size()).first;
+			channels.push_back(ChannelInfo{ .index = index_iter->second, .connection = index_iter->first });
+			WFQ_COUNT(new_channels);
 		}
-		else {
-			// If the channel already exists, add the packet to its queue.
-			iter->second->Q.push(*next_packet);
+		WFQ_PHASE(enqueue);
+		ChannelInfo& channel = channels[index_iter->second];
+		bool was_active = !channel.Q.empty();
+		if (!was_active) {
+			// An inactive channel starts over with the packet's weight, or the default weight if not specified.
+			channel.weight = packet.has_explicit_weight ? packet.weight : 1.0;
+		}
+		else if (packet.has_explicit_weight) {
 			// Update the weight if the packet has an explicit weight.
-			if (next_packet->has_explicit_weight) {
-				iter->second->weight = next_packet->weight;
-			}
+			if (packet.weight != channel.weight) WFQ_COUNT(weight_changes);
+			channel.weight = packet.weight;
+		}
+		channel.Q.push(packet);
+		WFQ_COUNT_PEAK(queue_depth, channel.Q.size());
+		// The channel's priority changes if it has a new first packet, or a new weight.
+		if (!was_active || packet.has_explicit_weight) {
+			update_channel_priority(channel);
 		}
 		// Reset the next_packet so we can read the next one in the next iteration.
 		next_packet.reset();
@@ -163,39 +246,36 @@ size_t read_with_timeout(uint64_t max_time) {
 int main() {
 	uint64_t time = 0;
 	while (true) {
-		if (channels.empty()) {
-			if (read_batch() == 0) break;
-			time = channels.front().Q.front().time;
+		WFQ_PHASE(schedule);
+		skip_stale_entries();
+		if (active_channels.empty()) {
+			// If there are no active channels, flush the output and read a batch of packets.
+			WFQ_PHASE(output);
+			output.flush();
+			// The link starts again at the arrival time of the first packet of the batch.
+			if (!peek_packet()) break;
+			time = next_packet->packet.time;
+			read_batch();
+			WFQ_PHASE(schedule);
+			skip_stale_entries();
 		}
-		// Find the channel with the earliest packet.
-		channels.erase(std::remove_if(channels.begin(), channels.end(),
-			[](const ChannelInfo& ch) { return ch.Q.empty(); }),
-			channels.end());
-		if (channels.empty()) break;
-		auto earliest_channel_iter = std::min_element(channels.begin(), channels.end(),
-			[](const ChannelInfo& a, const ChannelInfo& b) {
-				// Compare by the finish time of the first packet in the queue.
-				if (a.Q.front().length / a.weight != b.Q.front().length / b.weight) {
-					return a.Q.front().length / a.weight < b.Q.front().length / b.weight;
-				}
-				else
-				{
-					return a.index < b.index; // If finish time is equal, compare by index to maintain a stable order.
-				}
-			});
-		if (earliest_channel_iter == channels.end()) break; // No channels left to process.
-		ChannelInfo& earliest_channel = *earliest_channel_iter;
-		// Process the earliest packet in the queue of the earliest channel.
-		PacketInfo p = earliest_channel.Q.front(); earliest_channel.Q.pop();
-		std::cout << time << ": " << p << std::endl;
+		// Take the channel with the smallest priority (the length of its first packet divided by its weight).
+		ChannelInfo& earliest_channel = channels[active_channels.top().index];
+		active_channels.pop();
+		WFQ_COUNT(heap_pops);
+		// Process the earliest packet in the queue of the earliest channel, writing it straight from the queue.
+		const PacketInfo& p = earliest_channel.Q.front();
+		WFQ_PHASE(output);
+		p.write(output, time, earliest_channel.connection);
+		WFQ_PHASE(schedule);
 		// Update the virtual time.
 		time += p.length;
-		// Update the virtual time for the channel.
-		if (earliest_channel.Q.empty()) {
-			channelsMap.erase(earliest_channel.connection);
-			channels.erase(earliest_channel_iter);
+		earliest_channel.Q.pop();
+		// Update the channel's priority for its next packet.
+		if (!earliest_channel.Q.empty()) {
+			update_channel_priority(earliest_channel);
 		}
 		// Read new packets that arrived while the previous packet was being transmitted.
 		read_with_timeout(time);
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "uring_io.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Writes the transmitted packets to stdout.
+// Lines are formatted directly into a reusable buffer (with std::to_chars, so nothing is allocated per line),
+// and the buffer is written to stdout in large blocks, instead of flushing after every packet.
+// The buffer is flushed when it fills up, when flush() is called, and when the writer is destroyed.
+// With enable_io_uring(), the buffer is written by a UringWriter (see uring_io.h), which doesn't wait for the writes.
+class OutputWriter {
+public:
+    // The writer flushes its buffer when it holds at least this many bytes.
+    static constexpr size_t flush_threshold = 1 << 16;
+    // An upper bound on the length of a formatted number (a uint64_t, or a weight with 2 decimal places).
+    static constexpr size_t max_number_length = 352;
+
+    OutputWriter() {
+        buffer_.reserve(flush_threshold + 2 * max_number_length);
+    }
+
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    ~OutputWriter() {
+        finish();
+    }
+
+    // Writes the output with io_uring instead of stdio, if io_uring is available. Returns true if it is used.
+    // Nothing else may write to stdout afterwards, until finish() is called.
+    bool enable_io_uring() {
+#ifdef WFQ_HAVE_IO_URING
+        std::fflush(stdout);
+        auto writer = std::make_unique<UringWriter>();
+        if (!writer->start(STDOUT_FILENO)) return false;
+        uring_ = std::move(writer);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Writes a line for a packet that was transmitted at the given time:
+    // "time: packet_time connection length", followed by " weight" (with 2 decimal places) if the weight is given.
+    void write_packet(uint64_t time, uint64_t packet_time, std::string_view connection, uint64_t length,
+        std::optional<double> weight) {
+        append_number(time);
+        append(": ");
+        append_number(packet_time);
+        append(" ");
+        append(connection);
+        append(" ");
+        append_number(length);
+        if (weight.has_value()) {
+            append(" ");
+            append_weight(*weight);
+        }
+        append("\n");
+        if (buffer_.size() >= flush_threshold) write_buffer();
+    }
+
+    // Writes raw bytes (for the binary output, see binary_trace.h).
+    void write_bytes(std::string_view bytes) {
+        append(bytes);
+        if (buffer_.size() >= flush_threshold) write_buffer();
+    }
+
+    // Writes everything in the buffer to stdout. With io_uring, the writes are only submitted.
+    void flush() {
+        write_buffer();
+#ifdef WFQ_HAVE_IO_URING
+        if (uring_ != nullptr) uring_->submit_all();
+#endif
+    }
+
+    // Returns the number of bytes of output so far, including the ones still in the buffer
+    // (and the output before the checkpoint, after resume_at()).
+    uint64_t position() const {
+        return written_ + buffer_.size();
+    }
+
+    // Continues the output of a run that was checkpointed at the given position (see position()), before anything
+    // is written. If stdout is a regular file (for example, the output of that run, opened to be appended to),
+    // whatever it has past the position (the output written after the checkpoint) is cut, so it continues right there.
+    void resume_at(uint64_t position) {
+        written_ = position;
+#if defined(__unix__) || defined(__APPLE__)
+        std::fflush(stdout);
+        struct stat st;
+        if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_size) >= position) {
+            if (ftruncate(STDOUT_FILENO, static_cast<off_t>(position)) == 0) {
+                lseek(STDOUT_FILENO, static_cast<off_t>(position), SEEK_SET);
+            }
+        }
+#endif
+    }
+
+    // Writes everything in the buffer to stdout, and waits until it is written.
+    void finish() {
+        flush();
+#ifdef WFQ_HAVE_IO_URING
+        if (uring_ != nullptr) uring_->finish();
+#endif
+    }
+
+private:
+    // Writes the buffer to stdout, without waiting for the writes with io_uring.
+    void write_buffer() {
+        written_ += buffer_.size();
+#ifdef WFQ_HAVE_IO_URING
+        if (uring_ != nullptr) {
+            if (!buffer_.empty()) uring_->write(buffer_);
+            buffer_.clear();
+            return;
+        }
+#endif
+        if (!buffer_.empty()) {
+            std::fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+            buffer_.clear();
+        }
+        std::fflush(stdout);
+    }
+
+    void append(std::string_view text) {
+        buffer_.insert(buffer_.end(), text.begin(), text.end());
+    }
+
+    void append_number(uint64_t value) {
+        char digits[max_number_length];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.insert(buffer_.end(), digits, result.ptr);
+    }
+
+    // Formats a weight the same way as std::format("{:.2f}").
+    void append_weight(double value) {
+        char digits[max_number_length];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, 2);
+        buffer_.insert(buffer_.end(), digits, result.ptr);
+    }
+
+    std::vector<char> buffer_;
+    // The number of bytes written from the buffer so far.
+    uint64_t written_ = 0;
+#ifdef WFQ_HAVE_IO_URING
+    // The writer of the output, with enable_io_uring().
+    std::unique_ptr<UringWriter> uring_;
+#endif
+};
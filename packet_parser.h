@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "simd_scan.h"
+
+// A specialized parser for input lines of the form "time sadd sport dadd dport length [weight]".
+// It replaces sscanf: the line is tokenized in place, the numbers are converted with std::from_chars
+// (or, for anything but plain decimal numbers, with the same C functions as sscanf),
+// and the connection is returned as a view into the line instead of a newly allocated string.
+// The rare lines where a number is followed by other characters in the same token are parsed field by field instead.
+// The token boundaries are found 64 characters at a time with whitespace masks, and plain decimal numbers of up to
+// 16 digits are converted with SWAR arithmetic (see simd_scan.h).
+
+// The fields of one input line.
+struct PacketLine {
+    // The time when the packet arrived.
+    uint64_t time = 0;
+    // The packet's connection, as "sadd sport dadd dport".
+    // Note: this is a view into the input line, so it is only valid as long as the line is.
+    std::string_view connection;
+    // The packet's length.
+    uint64_t length = 0;
+    // The packet's weight, if written explicitly.
+    std::optional<double> weight;
+};
+
+// A hash for maps keyed by connection strings, which allows looking them up by std::string_view (such as
+// PacketLine::connection) without creating a std::string. Use it with std::equal_to<>.
+struct ConnectionHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view connection) const {
+        return std::hash<std::string_view>{}(connection);
+    }
+};
+
+// Calls convert(const char*) with a null-terminated copy of a token, for the C conversion functions
+// (the token itself is not null-terminated), and returns its result.
+template <class Convert>
+auto with_terminated_token(std::string_view token, Convert&& convert) {
+    char buffer[64];
+    if (token.size() < sizeof(buffer)) {
+        std::memcpy(buffer, token.data(), token.size());
+        buffer[token.size()] = '\0';
+        return convert(static_cast<const char*>(buffer));
+    }
+    std::string copy(token);
+    return convert(copy.c_str());
+}
+
+// A number read from the start of a token, and the number of characters it takes.
+template <class T>
+struct TokenNumber {
+    T value = 0;
+    size_t length = 0;
+};
+
+// Reads an unsigned integer from the start of a token the same way as sscanf's %llu: an optional sign followed by
+// decimal digits. Like sscanf, only a prefix of the token has to be a number (so "0x10" is 0), a leading minus sign
+// negates the value modulo 2^64, and a value that doesn't fit in 64 bits saturates to UINT64_MAX.
+// Returns std::nullopt if the token does not start with a number.
+inline std::optional<TokenNumber<uint64_t>> read_uint(std::string_view token) {
+    uint64_t value = 0;
+    // The common case: a token of only digits, which is short enough not to overflow.
+    if (parse_digits(token.data(), token.size(), value)) return TokenNumber<uint64_t>{ value, token.size() };
+    // Anything else is converted by strtoull, which is what sscanf uses.
+    return with_terminated_token(token, [](const char* text) -> std::optional<TokenNumber<uint64_t>> {
+        // Unlike sscanf, strtoull skips leading whitespace, but tokens never start with whitespace.
+        char* end = nullptr;
+        unsigned long long result = std::strtoull(text, &end, 10);
+        if (end == text) return std::nullopt;
+        return TokenNumber<uint64_t>{ static_cast<uint64_t>(result), static_cast<size_t>(end - text) };
+    });
+}
+
+// Returns true if sscanf's %lf fails on a token that strtod reads a number from. sscanf can only put back one
+// character that turns out not to be part of the number, so (in glibc) it fails on "0x" that isn't followed by
+// a hexadecimal digit or a point, and on "inf" followed by an 'i' that doesn't start "infinity" (in any case).
+inline bool scanf_rejects_double(std::string_view token) {
+    if (!token.empty() && (token[0] == '+' || token[0] == '-')) token.remove_prefix(1);
+    auto starts_with = [&token](std::string_view prefix) {
+        if (token.size() < prefix.size()) return false;
+        for (size_t i = 0; i < prefix.size(); i++) {
+            if ((token[i] | 0x20) != prefix[i]) return false;
+        }
+        return true;
+    };
+    if (starts_with("0x")) return token.size() == 2 || (!std::isxdigit(static_cast<unsigned char>(token[2])) &&
+        token[2] != '.');
+    return starts_with("infi") && !starts_with("infinity");
+}
+
+// Reads a floating point number from the start of a token the same way as sscanf's %lf.
+// Like sscanf, only a prefix of the token has to be a number, hexadecimal numbers (such as "0x10"), infinities and
+// NaNs are accepted, and a value out of range saturates to HUGE_VAL (or underflows towards 0).
+// Returns std::nullopt if the token does not start with a number.
+inline std::optional<TokenNumber<double>> read_double(std::string_view token) {
+    // The common case: a token that is all a decimal number. std::from_chars rounds the same way as strtod.
+    double value = 0;
+    auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (ec == std::errc() && ptr == token.data() + token.size()) return TokenNumber<double>{ value, token.size() };
+    // Anything else (a sign, a hexadecimal number, a suffix, or a value out of range) is converted by strtod,
+    // which is what sscanf uses.
+    if (scanf_rejects_double(token)) return std::nullopt;
+    return with_terminated_token(token, [](const char* text) -> std::optional<TokenNumber<double>> {
+        char* end = nullptr;
+        double result = std::strtod(text, &end);
+        if (end == text) return std::nullopt;
+        return TokenNumber<double>{ result, static_cast<size_t>(end - text) };
+    });
+}
+
+// Parses a whole token as an unsigned integer, like sscanf's %llu (see read_uint).
+inline std::optional<uint64_t> parse_uint(std::string_view token) {
+    std::optional<TokenNumber<uint64_t>> number = read_uint(token);
+    if (!number.has_value()) return std::nullopt;
+    return number->value;
+}
+
+// Parses a token as a floating point number, like sscanf's %lf (see read_double).
+inline std::optional<double> parse_double(std::string_view token) {
+    std::optional<TokenNumber<double>> number = read_double(token);
+    if (!number.has_value()) return std::nullopt;
+    return number->value;
+}
+
+// Moves the four connection fields of a line together, if they are separated by anything other than a single space,
+// and returns the connection, "sadd sport dadd dport". Each field must be followed by whitespace.
+inline std::string_view join_connection(const std::span<char> (&fields)[4]) {
+    char* connection_end = fields[0].data() + fields[0].size();
+    for (size_t i = 1; i < 4; i++) {
+        if (fields[i].data() != connection_end + 1 || *connection_end != ' ') {
+            *connection_end = ' ';
+            std::memmove(connection_end + 1, fields[i].data(), fields[i].size());
+        }
+        connection_end += 1 + fields[i].size();
+    }
+    return std::string_view(fields[0].data(), connection_end);
+}
+
+// Parses an input line field by field, exactly as sscanf("%llu %s %s %s %s %llu %lf") does, for the lines where
+// a number is followed by other characters in the same token: those characters start the next field (so "5a 1 b 2 100"
+// has the time 5 and the source address "a"), and after the length, a weight only if they are a number.
+inline std::optional<PacketLine> parse_packet_line_slowly(std::span<char> line) {
+    char* position = line.data();
+    char* const end = line.data() + line.size();
+    // Skips whitespace, and returns the rest of the token at the current position (which may be empty).
+    auto next_token = [&position, end]() {
+        while (position != end && is_space(*position)) position++;
+        char* token_end = position;
+        while (token_end != end && !is_space(*token_end)) token_end++;
+        return std::string_view(position, token_end);
+    };
+    PacketLine result;
+    std::optional<TokenNumber<uint64_t>> time = read_uint(next_token());
+    if (!time.has_value()) return std::nullopt;
+    result.time = time->value;
+    position += time->length;
+    std::span<char> fields[4];
+    for (std::span<char>& field : fields) {
+        std::string_view token = next_token();
+        if (token.empty()) return std::nullopt;
+        field = std::span<char>(position, token.size());
+        position += token.size();
+    }
+    std::optional<TokenNumber<uint64_t>> length = read_uint(next_token());
+    if (!length.has_value()) return std::nullopt;
+    result.length = length->value;
+    position += length->length;
+    if (std::optional<TokenNumber<double>> weight = read_double(next_token())) result.weight = weight->value;
+    result.connection = join_connection(fields);
+    return result;
+}
+
+// Parses an input line.
+// The line may be modified in place: if the four connection fields are not separated by single spaces,
+// they are moved together, so that the returned connection is always "sadd sport dadd dport".
+// Returns std::nullopt if the line is not a valid packet line
+// (that is, if it did not contain exactly 6 or 7 parameters, in the same sense as sscanf).
+inline std::optional<PacketLine> parse_packet_line(std::span<char> line) {
+    // Split the line into (up to 7) whitespace separated tokens.
+    constexpr size_t max_tokens = 7;
+    std::span<char> tokens[max_tokens];
+    size_t num_tokens = 0;
+    char* const begin = line.data();
+    const size_t size = line.size();
+    // Each block of 64 characters is classified at once, and the tokens begin and end where the class changes.
+    bool in_token = false;
+    size_t token_begin = 0;
+    for (size_t base = 0; base < size && num_tokens < max_tokens; base += 64) {
+        size_t block_size = std::min<size_t>(64, size - base);
+        uint64_t valid = block_size == 64 ? ~uint64_t(0) : (uint64_t(1) << block_size) - 1;
+        uint64_t token_chars = ~whitespace_mask(begin + base, block_size) & valid;
+        // Bit i is set if character i is in a token and character i - 1 isn't, or the other way around.
+        uint64_t changes = (token_chars ^ ((token_chars << 1) | (in_token ? 1 : 0))) & valid;
+        while (changes != 0 && num_tokens < max_tokens) {
+            size_t at = base + static_cast<size_t>(std::countr_zero(changes));
+            changes &= changes - 1;
+            if (in_token) tokens[num_tokens++] = std::span<char>(begin + token_begin, begin + at);
+            else token_begin = at;
+            in_token = !in_token;
+        }
+    }
+    if (in_token && num_tokens < max_tokens) tokens[num_tokens++] = std::span<char>(begin + token_begin, begin + size);
+    // With fewer tokens, the line may still have 6 fields if a number is followed by another field in its token.
+    if (num_tokens < 6) return parse_packet_line_slowly(line);
+
+    auto view = [](std::span<char> token) { return std::string_view(token.data(), token.size()); };
+    // A time or a length followed by other characters in the same token is parsed field by field instead.
+    std::optional<TokenNumber<uint64_t>> time = read_uint(view(tokens[0]));
+    std::optional<TokenNumber<uint64_t>> length = read_uint(view(tokens[5]));
+    if (!time.has_value() || time->length != tokens[0].size() || !length.has_value() ||
+        length->length != tokens[5].size()) {
+        return parse_packet_line_slowly(line);
+    }
+    PacketLine result;
+    result.time = time->value;
+    result.length = length->value;
+    if (num_tokens == 7) {
+        // As with sscanf, a 7th field that is not a number is ignored.
+        result.weight = parse_double(view(tokens[6]));
+    }
+    const std::span<char> fields[4] = { tokens[1], tokens[2], tokens[3], tokens[4] };
+    result.connection = join_connection(fields);
+    return result;
+}
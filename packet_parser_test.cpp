@@ -0,0 +1,136 @@
+// Tests of packet_parser.h (run with "make check"): the fields of a line must be parsed the same way as with sscanf.
+// Exits with an error if any test fails.
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+
+#include "packet_parser.h"
+
+int failures = 0;
+
+// Reports a failed check.
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures++; \
+        } \
+    } while (false)
+
+// Parses a line (from a copy of it, since the parser may modify the line).
+std::optional<PacketLine> parse(std::string& line) {
+    return parse_packet_line(std::span<char>(line.data(), line.size()));
+}
+
+int main() {
+    // Plain decimal numbers, which take the fast paths.
+    CHECK(parse_uint("0") == 0u);
+    CHECK(parse_uint("1234567890123456") == 1234567890123456u);
+    CHECK(parse_double("0.25") == 0.25);
+    CHECK(parse_double("3") == 3.0);
+
+    // Signs.
+    CHECK(parse_uint("+12") == 12u);
+    CHECK(parse_uint("-1") == UINT64_MAX);
+    CHECK(parse_double("+2.5") == 2.5);
+    CHECK(parse_double("-2.5") == -2.5);
+
+    // Hexadecimal numbers: %llu stops at the 'x', and %lf reads a hexadecimal number.
+    CHECK(parse_uint("0x10") == 0u);
+    CHECK(parse_double("0x10") == 16.0);
+    CHECK(parse_double("0x1.8p1") == 3.0);
+
+    // Values out of range saturate.
+    CHECK(parse_uint("18446744073709551615") == UINT64_MAX);
+    CHECK(parse_uint("18446744073709551616") == UINT64_MAX);
+    CHECK(parse_uint("123456789012345678901234567890") == UINT64_MAX);
+    CHECK(parse_double("1e400") == HUGE_VAL);
+    CHECK(parse_double("-1e400") == -HUGE_VAL);
+    CHECK(parse_double("1e-400") == 0.0);
+    // A long token, which doesn't fit in the buffer of with_terminated_token.
+    CHECK(parse_uint(std::string(100, '9')) == UINT64_MAX);
+
+    // Only a prefix of the token has to be a number.
+    CHECK(parse_uint("100abc") == 100u);
+    CHECK(parse_double("2.5x") == 2.5);
+    CHECK(parse_double("1e") == 1.0);
+    CHECK(parse_double("inf") == HUGE_VAL);
+    CHECK(!parse_uint("abc").has_value());
+    CHECK(!parse_uint("-").has_value());
+    CHECK(!parse_double("x1").has_value());
+    CHECK(!parse_double(".").has_value());
+    // sscanf fails where it reads more than one character that is not part of the number.
+    CHECK(!parse_double("0xg").has_value());
+    CHECK(parse_double("0x.1") == 0.0625);
+    CHECK(!parse_double("infi").has_value());
+    CHECK(parse_double("-infinity") == -HUGE_VAL);
+
+    // Whole lines.
+    {
+        std::string line = "10 1.2.3.4 80 5.6.7.8 90 100";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->time == 10 && packet->length == 100 && !packet->weight.has_value() &&
+            packet->connection == "1.2.3.4 80 5.6.7.8 90");
+    }
+    {
+        std::string line = "10\ta  1\t b 2 100 0x10";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->weight == 16.0 && packet->connection == "a 1 b 2");
+    }
+    {
+        std::string line = "99999999999999999999 a 1 b 2 100 1e400";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->time == UINT64_MAX && packet->length == 100 && packet->weight == HUGE_VAL);
+    }
+    {
+        // As with sscanf, the characters after a number start the next field: here the weight, which is not a number.
+        std::string line = "0 a 1 b 2 100abc 1e400";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->length == 100 && !packet->weight.has_value());
+    }
+    {
+        std::string line = "0 a 1 b 2 100.5";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->length == 100 && packet->weight == 0.5);
+    }
+    {
+        // The time is 5, and the connection starts right after it.
+        std::string line = "5a 1 b 2 100";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->time == 5 && packet->length == 100 && !packet->weight.has_value() &&
+            packet->connection == "a 1 b 2");
+    }
+    {
+        std::string line = "5a\t1  b 2 100 2";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && packet->time == 5 && packet->weight == 2.0 && packet->connection == "a 1 b 2");
+    }
+    {
+        std::string line = "5a 1 b 2";
+        CHECK(!parse(line).has_value());
+    }
+    {
+        // As with sscanf, a 7th field that is not a number is ignored.
+        std::string line = "10 a 1 b 2 100 heavy";
+        auto packet = parse(line);
+        CHECK(packet.has_value() && !packet->weight.has_value());
+    }
+    {
+        std::string line = "10 a 1 b 2";
+        CHECK(!parse(line).has_value());
+    }
+    {
+        std::string line = "x a 1 b 2 100";
+        CHECK(!parse(line).has_value());
+    }
+
+    if (failures != 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "packet_parser_test: all checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A FIFO queue of packets stored in a PacketPool.
+// The queue itself only holds the indices of its first and last packets; the packets are linked through the pool.
+struct PacketQueue {
+    // The index of the first packet in the pool, or PacketPool::none if the queue is empty.
+    uint32_t head = UINT32_MAX;
+    // The index of the last packet in the pool, or PacketPool::none if the queue is empty.
+    uint32_t tail = UINT32_MAX;
+    // The number of packets in the queue.
+    uint32_t size = 0;
+
+    bool empty() const {
+        return size == 0;
+    }
+};
+
+// A pool of packets shared by all the channels' queues.
+// All the packets live in one contiguous array, and each queue is an intrusive doubly linked list of indices into it.
+// Freed slots are kept in a free list and reused, so after warming up, queueing a packet does not allocate memory,
+// and a channel that holds one packet costs a single slot instead of a separately allocated deque chunk.
+template <class T>
+class PacketPool {
+public:
+    // An index that does not refer to any packet.
+    static constexpr uint32_t none = UINT32_MAX;
+
+    // Creates a pool with room for initial_capacity packets.
+    explicit PacketPool(size_t initial_capacity = 1 << 16) {
+        nodes_.reserve(initial_capacity);
+    }
+
+    // Adds a packet to the end of a queue. The packet is moved into the pool.
+    void push(PacketQueue& queue, T value) {
+        uint32_t index = allocate();
+        nodes_[index].value = std::move(value);
+        nodes_[index].next = none;
+        nodes_[index].prev = queue.tail;
+        if (queue.tail == none) queue.head = index;
+        else nodes_[queue.tail].next = index;
+        queue.tail = index;
+        queue.size++;
+    }
+
+    // Returns the first packet of a non-empty queue.
+    T& front(const PacketQueue& queue) {
+        assert(!queue.empty());
+        return nodes_[queue.head].value;
+    }
+
+    // Removes the first packet of a non-empty queue.
+    void pop(PacketQueue& queue) {
+        assert(!queue.empty());
+        uint32_t index = queue.head;
+        queue.head = nodes_[index].next;
+        if (queue.head == none) queue.tail = none;
+        else nodes_[queue.head].prev = none;
+        queue.size--;
+        release(index);
+    }
+
+    // Returns the last packet of a non-empty queue.
+    T& back(const PacketQueue& queue) {
+        assert(!queue.empty());
+        return nodes_[queue.tail].value;
+    }
+
+    // Removes the last packet of a non-empty queue.
+    void pop_back(PacketQueue& queue) {
+        assert(!queue.empty());
+        uint32_t index = queue.tail;
+        queue.tail = nodes_[index].prev;
+        if (queue.tail == none) queue.head = none;
+        else nodes_[queue.tail].next = none;
+        queue.size--;
+        release(index);
+    }
+
+    // Calls f(packet) for each packet of a queue, from the first to the last.
+    template <class F>
+    void for_each(const PacketQueue& queue, F&& f) const {
+        for (uint32_t index = queue.head; index != none; index = nodes_[index].next) f(nodes_[index].value);
+    }
+
+private:
+    struct Node {
+        T value;
+        // The index of the next packet in the same queue (or in the free list), or none.
+        uint32_t next;
+        // The index of the previous packet in the same queue, or none.
+        uint32_t prev;
+    };
+
+    // Adds a node to the free list.
+    void release(uint32_t index) {
+        nodes_[index].next = free_list_;
+        free_list_ = index;
+    }
+
+    // Returns the index of an unused node.
+    uint32_t allocate() {
+        if (free_list_ != none) {
+            uint32_t index = free_list_;
+            free_list_ = nodes_[index].next;
+            return index;
+        }
+        nodes_.emplace_back();
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+
+    std::vector<Node> nodes_;
+    // The first unused node, or none.
+    uint32_t free_list_ = none;
+};
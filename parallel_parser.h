@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "packet_parser.h"
+
+// Parses a whole (memory-mapped) input in parallel.
+// The input is split at line boundaries into one chunk per thread, and each thread parses its chunk
+// into its own array of PacketLine's (see parse_packet_line). The connections of the results are views
+// into the input, and lines are tokenized in place, so the input must stay valid and must not be shared.
+//
+// Nothing global is touched, so the caller can intern the connections afterwards, going over the chunks in order,
+// to assign channel ids in the same order as a serial reader would.
+
+// The result of parsing one chunk of the input.
+struct ParsedChunk {
+    // The packet lines of the chunk, in order, up to the first bad line.
+    std::vector<PacketLine> packets;
+    // The first line of the chunk that is not a valid packet line, if any.
+    // The lines of the chunk after it are not parsed.
+    std::optional<std::string_view> bad_line;
+};
+
+// Parses the lines of one chunk, the same way as InputReader::next_line followed by parse_packet_line.
+inline ParsedChunk parse_chunk(std::span<char> chunk) {
+    ParsedChunk result;
+    // A rough guess of the number of lines, so the array is rarely reallocated.
+    result.packets.reserve(chunk.size() / 32);
+    char* pos = chunk.data();
+    char* const end = chunk.data() + chunk.size();
+    while (pos != end) {
+        char* newline = static_cast<char*>(std::memchr(pos, '\n', end - pos));
+        char* line_end = newline != nullptr ? newline : end;
+        std::span<char> line(pos, line_end);
+        pos = newline != nullptr ? newline + 1 : end;
+
+        std::string_view original_line(line.data(), line.size());
+        std::optional<PacketLine> parsed = parse_packet_line(line);
+        if (!parsed.has_value()) {
+            result.bad_line = original_line;
+            break;
+        }
+        result.packets.push_back(*parsed);
+    }
+    return result;
+}
+
+// Splits the input into (at most) num_threads chunks that end at line boundaries, and parses them in parallel.
+// Returns the parsed chunks, in the order of the input.
+inline std::vector<ParsedChunk> parse_in_parallel(std::span<char> input, unsigned num_threads) {
+    if (num_threads == 0) num_threads = 1;
+    // Each chunk ends right after a '\n' (except the last one), so no line is split between two chunks.
+    std::vector<std::span<char>> chunks;
+    char* begin = input.data();
+    char* const end = input.data() + input.size();
+    for (unsigned i = 1; i <= num_threads && begin != end; i++) {
+        char* chunk_end = end;
+        if (i < num_threads) {
+            char* target = input.data() + input.size() / num_threads * i;
+            if (target < begin) target = begin;
+            char* newline = static_cast<char*>(std::memchr(target, '\n', end - target));
+            if (newline != nullptr) chunk_end = newline + 1;
+        }
+        chunks.emplace_back(begin, chunk_end);
+        begin = chunk_end;
+    }
+
+    std::vector<ParsedChunk> results(chunks.size());
+    std::vector<std::thread> threads;
+    // The first chunk is parsed by the calling thread.
+    for (size_t i = 1; i < chunks.size(); i++) {
+        threads.emplace_back([&results, &chunks, i] { results[i] = parse_chunk(chunks[i]); });
+    }
+    if (!chunks.empty()) results[0] = parse_chunk(chunks[0]);
+    for (std::thread& thread : threads) thread.join();
+    return results;
+}
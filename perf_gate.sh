@@ -0,0 +1,158 @@
+#!/bin/sh
+# Checks that the fast paths of wfq.exe keep its output, and that the throughput of both programs doesn't regress
+# (run with "make perf-gate"). Exits with an error if any check fails.
+#
+# For each scenario (see bench_lib.sh):
+# - Every variant of wfq.exe (the other priority queues, fixed-point virtual times, the unweighted scheduler,
+#   the pipelined, parallel-parsing and sharded modes, and the binary formats) must write exactly the same output as
+#   wfq.exe. The two outputs are streamed through pipes into cmp, so they are never stored, and a difference stops
+#   both runs right away.
+# - With --shards 4, wfq.exe schedules several links, so its output can only be checked to have the same packets as
+#   wfq.exe's, merged in the order of their transmit times.
+# - new_wfq.exe uses a different scheduling rule, so its output can only be checked against wfq.exe's for what they
+#   must agree on: both must transmit exactly the same packets, and never transmit a packet before it arrives or while
+#   the link is busy.
+# - The throughput (packets/s) of wfq_bench.exe and new_wfq_bench.exe, the best of PERF_GATE_RUNS runs, must not be
+#   lower than the stored baseline by more than PERF_GATE_THRESHOLD percent. The baseline of a scenario and program
+#   is recorded the first time it is run (the numbers depend on the machine, so the baseline isn't committed).
+#
+# Environment variables (and the ones of bench_lib.sh, which sets the trace size, the seed and the scenarios):
+#   PERF_GATE_BASELINE   the baseline file (default: $BENCH_DIR/perf_baseline.txt)
+#   PERF_GATE_THRESHOLD  the allowed throughput regression, in percent (default: 10)
+#   PERF_GATE_RUNS       the number of runs of each benchmark (default: 3)
+#   PERF_GATE_UPDATE     if 1, record the new throughput as the baseline, instead of checking it
+
+set -e
+
+. ./bench_lib.sh
+
+baseline=${PERF_GATE_BASELINE:-$dir/perf_baseline.txt}
+threshold=${PERF_GATE_THRESHOLD:-10}
+runs=${PERF_GATE_RUNS:-3}
+update=${PERF_GATE_UPDATE:-0}
+
+mkdir -p "$dir"
+expected="$dir/expected.fifo"
+actual="$dir/actual.fifo"
+failures=0
+
+# Prints the result of a check, and counts it if it failed.
+report() {
+    if [ "$2" = ok ]; then
+        printf "%-11s %-40s ok\n" "$scenario" "$1"
+    else
+        printf "%-11s %-40s FAILED (%s)\n" "$scenario" "$1" "$2"
+        failures=$((failures + 1))
+    fi
+}
+
+# Runs two shell commands, and compares their outputs (streamed through fifos).
+# Succeeds if they are the same.
+same_output() {
+    rm -f "$expected" "$actual"
+    mkfifo "$expected" "$actual"
+    eval "$1" > "$expected" &
+    eval "$2" > "$actual" &
+    if cmp -s "$expected" "$actual"; then result=0; else result=1; fi
+    # After a difference, the commands get SIGPIPE.
+    wait || true
+    rm -f "$expected" "$actual"
+    return $result
+}
+
+# Checks that a variant of wfq.exe (a shell command that reads the trace) writes the same output as wfq.exe.
+check_variant() {
+    if same_output "./wfq.exe < \"\$trace\"" "$2"; then report "$1" ok; else report "$1" "output differs"; fi
+}
+
+# Prints the packets of an output (from stdin), without their transmit times, sorted.
+packets_of() {
+    cut -d ' ' -f 2- | LC_ALL=C sort
+}
+
+# Reads an output from stdin, and fails if a packet is transmitted before it arrives or before the previous one ends.
+check_link() {
+    awk '{
+        start = substr($1, 1, length($1) - 1) + 0
+        if (start < $2 + 0 || start < end) { print "bad transmit time, line " NR ": " $0 > "/dev/stderr"; exit 1 }
+        end = start + $7
+    }'
+}
+
+# Reads an output from stdin, and fails if the transmit times decrease.
+check_merged() {
+    awk '{
+        start = substr($1, 1, length($1) - 1) + 0
+        if (start < last) { print "transmit time out of order, line " NR ": " $0 > "/dev/stderr"; exit 1 }
+        last = start
+    }'
+}
+
+for scenario in $scenarios; do
+    trace=$(scenario_trace "$scenario")
+    binary_trace="${trace%.txt}.bin"
+    [ -f "$binary_trace" ] || ./trace_convert.exe to-binary < "$trace" > "$binary_trace"
+
+    check_variant wfq_calendar.exe './wfq_calendar.exe < "$trace"'
+    check_variant wfq_dary.exe './wfq_dary.exe < "$trace"'
+    check_variant "--pipelined" './wfq.exe --pipelined < "$trace"'
+    check_variant "--parse-threads 4" './wfq.exe --parse-threads 4 < "$trace"'
+    check_variant "--packed-keys" './wfq.exe --packed-keys < "$trace"'
+    check_variant "--shards 1" './wfq.exe --shards 1 < "$trace"'
+    check_variant "--input-format binary" './wfq.exe --input-format binary < "$binary_trace"'
+    check_variant "--output-format binary" \
+        './wfq.exe --output-format binary < "$trace" | ./trace_convert.exe to-text'
+    if scenario_is_unweighted "$scenario"; then
+        # With weights, rounding may order nearly equal finish times differently (see FixedPointVirtualClock).
+        check_variant wfq_fixed.exe './wfq_fixed.exe < "$trace"'
+        check_variant "--unweighted" './wfq.exe --unweighted < "$trace"'
+    fi
+
+    if same_output './wfq.exe < "$trace" | packets_of' './new_wfq.exe < "$trace" | packets_of'; then
+        report "new_wfq.exe: same packets" ok
+    else
+        report "new_wfq.exe: same packets" "the packets differ"
+    fi
+    if same_output './wfq.exe < "$trace" | packets_of' './wfq.exe --shards 4 < "$trace" | packets_of'; then
+        report "--shards 4: same packets" ok
+    else
+        report "--shards 4: same packets" "the packets differ"
+    fi
+    if ./wfq.exe --shards 4 < "$trace" | check_merged; then
+        report "--shards 4: merged" ok
+    else
+        report "--shards 4: merged" "not in transmit order"
+    fi
+    for program in wfq.exe new_wfq.exe; do
+        if "./$program" < "$trace" | check_link; then report "$program: link" ok; else report "$program: link" "bad schedule"; fi
+    done
+
+    for program in wfq_bench.exe new_wfq_bench.exe; do
+        best=0
+        i=0
+        while [ $i -lt "$runs" ]; do
+            rate=$("./$program" < "$trace" 2>&1 > /dev/null | awk '/^packets\/s:/ { print $2 }')
+            best=$(awk -v a="$best" -v b="$rate" 'BEGIN { print (b + 0 > a + 0) ? b : a }')
+            i=$((i + 1))
+        done
+        recorded=$(awk -v key="$scenario $program" '$1 " " $2 == key { print $3 }' "$baseline" 2>/dev/null || true)
+        if [ "$update" = 1 ] || [ -z "$recorded" ]; then
+            # Replace the old baseline of this scenario and program, if any.
+            awk -v key="$scenario $program" '$1 " " $2 != key' "$baseline" 2>/dev/null > "$baseline.new" || true
+            echo "$scenario $program $best" >> "$baseline.new"
+            mv "$baseline.new" "$baseline"
+            report "$program: $best packets/s" ok
+        elif awk -v best="$best" -v recorded="$recorded" -v threshold="$threshold" \
+            'BEGIN { exit !(best >= recorded * (1 - threshold / 100)) }'; then
+            report "$program: $best packets/s (baseline $recorded)" ok
+        else
+            report "$program: $best packets/s (baseline $recorded)" "more than $threshold% slower"
+        fi
+    done
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,237 @@
+#pragma once
+
+// Per-phase timing and hot-path counters, for benchmarks (see bench.sh).
+//
+// When compiled with -DWFQ_PHASE_TIMING, the program keeps track of which phase it is in
+// (WFQ_PHASE(parse) switches to the parse phase, and so on), counts events on the hot path (WFQ_COUNT(heap_pushes),
+// WFQ_COUNT_PEAK(queue_depth, size), and so on), and at exit prints to stderr the number of packets, the throughput,
+// the time spent in each phase per packet (in cycles and in ns), the counters, and the peak RSS.
+// If the environment variable WFQ_STATS is "json", the report is a single JSON object instead.
+// Otherwise, WFQ_PHASE, WFQ_COUNT_PACKET, WFQ_COUNT and WFQ_COUNT_PEAK compile to nothing.
+//
+// Phases are timed with the time-stamp counter on x86 (which is converted to ns by comparing it to the steady clock
+// over the whole run), and with the steady clock elsewhere (where "cycles" are ns).
+// Phases are only switched in the main thread, but counters may be updated by any thread: each thread counts
+// in its own thread_local HotCounters, which are added to the totals when the thread exits.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// The phases of processing a packet.
+enum class Phase {
+    // Reading the packet's line and parsing it.
+    parse,
+    // Finding (or creating) the packet's channel.
+    lookup,
+    // Adding the packet to its channel, and activating the channel.
+    enqueue,
+    // Choosing the next packet to transmit.
+    schedule,
+    // Formatting and writing the transmitted packet.
+    output,
+};
+
+// The events that are counted (see WFQ_COUNT).
+enum class Counter {
+    // Channels whose state was created (including channels that were created again after they were evicted).
+    new_channels,
+    // Entries pushed to and popped from the priority queue of active channels.
+    heap_pushes,
+    heap_pops,
+    // Packets that changed the weight of their channel.
+    weight_changes,
+};
+
+// The maximums that are recorded (see WFQ_COUNT_PEAK).
+enum class Peak {
+    // The size of the priority queue of active channels.
+    active_channels,
+    // The number of packets in a channel's queue.
+    queue_depth,
+};
+
+#ifdef WFQ_PHASE_TIMING
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define WFQ_HAVE_RDTSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define WFQ_HAVE_RDTSC 1
+#endif
+
+// The counters of one thread.
+struct HotCounters {
+    static constexpr int num_counters = 4;
+    static constexpr const char* counter_names[num_counters] = {
+        "new_channels", "heap_pushes", "heap_pops", "weight_changes" };
+    static constexpr int num_peaks = 2;
+    static constexpr const char* peak_names[num_peaks] = { "peak_active_channels", "peak_queue_depth" };
+
+    uint64_t counters[num_counters] = {};
+    uint64_t peaks[num_peaks] = {};
+
+    void add(const HotCounters& other) {
+        for (int i = 0; i < num_counters; i++) counters[i] += other.counters[i];
+        for (int i = 0; i < num_peaks; i++) peaks[i] = peaks[i] > other.peaks[i] ? peaks[i] : other.peaks[i];
+    }
+};
+
+// The counters of the threads that have exited.
+inline std::mutex hot_counter_totals_mutex;
+inline HotCounters hot_counter_totals;
+
+// The counters of the current thread, which are added to hot_counter_totals when the thread exits.
+struct ThreadHotCounters : HotCounters {
+    ~ThreadHotCounters() {
+        std::lock_guard<std::mutex> lock(hot_counter_totals_mutex);
+        hot_counter_totals.add(*this);
+    }
+};
+inline thread_local ThreadHotCounters thread_hot_counters;
+
+// Records a value of a peak in the current thread.
+inline void record_peak(Peak peak, uint64_t value) {
+    uint64_t& current = thread_hot_counters.peaks[static_cast<int>(peak)];
+    if (value > current) current = value;
+}
+
+// Returns the current value of the cycle counter.
+inline uint64_t read_cycles() {
+#ifdef WFQ_HAVE_RDTSC
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+class PhaseTimer {
+public:
+    static constexpr int num_phases = 5;
+    static constexpr const char* phase_names[num_phases] = { "parse", "lookup", "enqueue", "schedule", "output" };
+
+    PhaseTimer() : start_(Clock::now()), start_cycles_(read_cycles()), last_switch_(start_cycles_) {}
+
+    ~PhaseTimer() {
+        report();
+    }
+
+    // Ends the current phase, and starts the given phase.
+    void switch_to(Phase phase) {
+        uint64_t now = read_cycles();
+        totals_[static_cast<int>(current_)] += now - last_switch_;
+        last_switch_ = now;
+        current_ = phase;
+    }
+
+    void count_packet() {
+        packets_++;
+    }
+
+    // Prints the report to stderr. The counters of threads that are still running are not included.
+    void report() {
+        switch_to(current_);
+        double seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+        uint64_t cycles = last_switch_ - start_cycles_;
+        double ns_per_cycle = cycles > 0 ? seconds * 1e9 / static_cast<double>(cycles) : 0.0;
+        double packets = packets_ == 0 ? 1.0 : static_cast<double>(packets_);
+        // At exit, the counters of the main thread have already been added (thread_local objects are destroyed before
+        // static ones).
+        const HotCounters& counters = hot_counter_totals;
+        long peak_kib = peak_rss_kib();
+
+        const char* format = std::getenv("WFQ_STATS");
+        if (format != nullptr && std::strcmp(format, "json") == 0) {
+            std::fprintf(stderr, "{\"packets\": %llu, \"seconds\": %.6f, \"packets_per_second\": %.0f",
+                static_cast<unsigned long long>(packets_), seconds,
+                seconds > 0 ? static_cast<double>(packets_) / seconds : 0.0);
+            for (int i = 0; i < num_phases; i++) {
+                double phase_cycles = static_cast<double>(totals_[i]);
+                std::fprintf(stderr, ", \"cycles_per_packet_%s\": %.1f, \"ns_per_packet_%s\": %.1f", phase_names[i],
+                    phase_cycles / packets, phase_names[i], phase_cycles * ns_per_cycle / packets);
+            }
+            for (int i = 0; i < HotCounters::num_counters; i++) {
+                std::fprintf(stderr, ", \"%s\": %llu", HotCounters::counter_names[i],
+                    static_cast<unsigned long long>(counters.counters[i]));
+            }
+            for (int i = 0; i < HotCounters::num_peaks; i++) {
+                std::fprintf(stderr, ", \"%s\": %llu", HotCounters::peak_names[i],
+                    static_cast<unsigned long long>(counters.peaks[i]));
+            }
+            if (peak_kib >= 0) std::fprintf(stderr, ", \"peak_rss_kib\": %ld", peak_kib);
+            std::fprintf(stderr, "}\n");
+            return;
+        }
+
+        std::fprintf(stderr, "packets: %llu\n", static_cast<unsigned long long>(packets_));
+        std::fprintf(stderr, "seconds: %.3f\n", seconds);
+        std::fprintf(stderr, "packets/s: %.0f\n", seconds > 0 ? static_cast<double>(packets_) / seconds : 0.0);
+        for (int i = 0; i < num_phases; i++) {
+            double phase_cycles = static_cast<double>(totals_[i]);
+            std::fprintf(stderr, "ns/packet %s: %.1f\n", phase_names[i], phase_cycles * ns_per_cycle / packets);
+            std::fprintf(stderr, "cycles/packet %s: %.1f\n", phase_names[i], phase_cycles / packets);
+        }
+        for (int i = 0; i < HotCounters::num_counters; i++) {
+            std::fprintf(stderr, "%s: %llu\n", HotCounters::counter_names[i],
+                static_cast<unsigned long long>(counters.counters[i]));
+        }
+        for (int i = 0; i < HotCounters::num_peaks; i++) {
+            std::fprintf(stderr, "%s: %llu\n", HotCounters::peak_names[i],
+                static_cast<unsigned long long>(counters.peaks[i]));
+        }
+        if (peak_kib >= 0) std::fprintf(stderr, "peak RSS KiB: %ld\n", peak_kib);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Returns the peak RSS in KiB, or -1 if it is not known.
+    static long peak_rss_kib() {
+#if defined(__unix__) || defined(__APPLE__)
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+            return usage.ru_maxrss / 1024;
+#else
+            return usage.ru_maxrss;
+#endif
+        }
+#endif
+        return -1;
+    }
+
+    Clock::time_point start_;
+    uint64_t start_cycles_;
+    uint64_t last_switch_;
+    Phase current_ = Phase::parse;
+    uint64_t totals_[num_phases] = {};
+    uint64_t packets_ = 0;
+};
+
+// The program's phase timer. It prints its report when the program exits.
+inline PhaseTimer phase_timer;
+
+#define WFQ_PHASE(phase) phase_timer.switch_to(Phase::phase)
+#define WFQ_COUNT_PACKET() phase_timer.count_packet()
+#define WFQ_COUNT(counter) ((void)++thread_hot_counters.counters[static_cast<int>(Counter::counter)])
+#define WFQ_COUNT_N(counter, n) ((void)(thread_hot_counters.counters[static_cast<int>(Counter::counter)] += (n)))
+#define WFQ_COUNT_PEAK(peak, value) record_peak(Peak::peak, value)
+
+#else
+
+#define WFQ_PHASE(phase) ((void)0)
+#define WFQ_COUNT_PACKET() ((void)0)
+#define WFQ_COUNT(counter) ((void)0)
+#define WFQ_COUNT_N(counter, n) ((void)0)
+#define WFQ_COUNT_PEAK(peak, value) ((void)0)
+
+#endif
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WFQ_SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WFQ_SIMD_SSE2 1
+#elif (defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define WFQ_SIMD_NEON 1
+#endif
+
+// Building blocks for parsing input lines (see packet_parser.h) a block of characters at a time, instead of
+// one character at a time:
+// - whitespace_mask classifies up to 64 characters at once, with AVX2 (32 at a time), SSE2 (16 at a time, which every
+//   x86-64 CPU has) or AArch64 NEON (16 at a time), or one at a time where none of them is available.
+// - parse_digits converts up to 16 decimal digits with SWAR arithmetic (8 digits in a few 64-bit multiplications).
+
+// Returns true if c is a whitespace character, in the same sense as sscanf (in the "C" locale).
+inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Returns a mask with bit i set if data[i] is a whitespace character (see is_space), for i < size (at most 64).
+// The other bits are 0. Only the size characters at data are read.
+inline uint64_t whitespace_mask(const char* data, size_t size) {
+    uint64_t mask = 0;
+    size_t i = 0;
+#if defined(WFQ_SIMD_AVX2)
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    for (; i + 32 <= size; i += 32) {
+        __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        // c - '\t' <= 4 (as unsigned bytes) is '\t' <= c <= '\r'.
+        __m256i control = _mm256_sub_epi8(chars, tab);
+        __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control);
+        __m256i is_white = _mm256_or_si256(_mm256_cmpeq_epi8(chars, space), is_control);
+        mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(is_white))) << i;
+    }
+#elif defined(WFQ_SIMD_SSE2)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    for (; i + 16 <= size; i += 16) {
+        __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i control = _mm_sub_epi8(chars, tab);
+        __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(control, four), control);
+        __m128i is_white = _mm_or_si128(_mm_cmpeq_epi8(chars, space), is_control);
+        mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(is_white))) << i;
+    }
+#elif defined(WFQ_SIMD_NEON)
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t four = vdupq_n_u8(4);
+    // The weight of each lane's bit, to gather the 16 comparison results into 16 bits.
+    static const uint8_t bit_weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t weights = vld1q_u8(bit_weights);
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t chars = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+        uint8x16_t is_white = vorrq_u8(vceqq_u8(chars, space), vcleq_u8(vsubq_u8(chars, tab), four));
+        uint8x16_t bits = vandq_u8(is_white, weights);
+        uint64_t low = vaddv_u8(vget_low_u8(bits));
+        uint64_t high = vaddv_u8(vget_high_u8(bits));
+        mask |= (low | (high << 8)) << i;
+    }
+#endif
+    for (; i < size; i++) {
+        if (is_space(data[i])) mask |= uint64_t(1) << i;
+    }
+    return mask;
+}
+
+// The number of digits parse_digits can convert.
+inline constexpr size_t max_swar_digits = 16;
+
+// Converts 8 ASCII digits, stored in a little-endian uint64_t (the first digit in the lowest byte).
+inline uint64_t parse_eight_digits(uint64_t chars) {
+    chars -= 0x3030303030303030;
+    // Combine pairs of digits, then pairs of pairs, then the two halves.
+    chars = (chars * 10 + (chars >> 8)) & 0x00FF00FF00FF00FF;
+    chars = (chars * 100 + (chars >> 16)) & 0x0000FFFF0000FFFF;
+    return (chars * 10000 + (chars >> 32)) & 0xFFFFFFFF;
+}
+
+// Returns true if all the 8 characters stored in chars are ASCII digits.
+inline bool are_eight_digits(uint64_t chars) {
+    return (((chars & 0xF0F0F0F0F0F0F0F0) | (((chars + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+        == 0x3333333333333333);
+}
+
+// Converts a token of 1 to max_swar_digits decimal digits into value.
+// Returns false (and leaves value unchanged) if the token has another size, or a character that is not a digit,
+// so the caller can fall back to a general parser.
+inline bool parse_digits(const char* data, size_t size, uint64_t& value) {
+    if constexpr (std::endian::native != std::endian::little) {
+        return false;
+    }
+    else {
+        if (size == 0 || size > max_swar_digits) return false;
+        // Right-align the digits in 16 characters, padded with leading zeros.
+        char digits[max_swar_digits];
+        std::memset(digits, '0', sizeof(digits));
+        std::memcpy(digits + sizeof(digits) - size, data, size);
+        uint64_t high;
+        uint64_t low;
+        std::memcpy(&high, digits, 8);
+        std::memcpy(&low, digits + 8, 8);
+        if (!are_eight_digits(high) || !are_eight_digits(low)) return false;
+        value = parse_eight_digits(high) * 100000000 + parse_eight_digits(low);
+        return true;
+    }
+}
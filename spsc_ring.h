@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// A lock-free single-producer, single-consumer ring buffer, for passing items between the threads of the pipelined mode.
+// One thread may call push(), and one (other) thread may call pop().
+//
+// push() blocks while the ring is full, and pop() blocks while it is empty. Waiting spins for a short while,
+// then yields, and then sleeps for increasingly long periods (up to max_sleep), so an idle stage does not burn a core.
+// Each side caches the other side's position, and only reloads it when the ring looks full (or empty),
+// so the two threads rarely touch the same cache line.
+template <class T>
+class SpscRing {
+public:
+    // Creates a ring with room for capacity items (rounded up to a power of 2).
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size *= 2;
+        items_.resize(size);
+        mask_ = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Adds an item. Called only by the producer.
+    void push(const T& item) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == items_.size()) {
+            // The ring looks full: wait for the consumer to pop an item.
+            wait([&] {
+                cached_head_ = head_.load(std::memory_order_acquire);
+                return tail - cached_head_ != items_.size();
+            });
+        }
+        items_[tail & mask_] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+    }
+
+    // Adds an item if the ring is not full, without waiting. Returns true if it was added. Called only by the producer.
+    bool try_push(const T& item) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == items_.size()) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == items_.size()) return false;
+        }
+        items_[tail & mask_] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Removes and returns the first item. Called only by the consumer.
+    T pop() {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_) {
+            // The ring looks empty: wait for the producer to push an item.
+            wait([&] {
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+                return head != cached_tail_;
+            });
+        }
+        T item = items_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return item;
+    }
+
+private:
+    // The number of times to check before yielding, and before sleeping.
+    static constexpr int spin_count = 64;
+    static constexpr int yield_count = 64;
+    static constexpr std::chrono::microseconds max_sleep{ 100 };
+
+    // Waits until ready() returns true.
+    template <class Ready>
+    static void wait(Ready ready) {
+        for (int i = 0; i < spin_count; i++) {
+            if (ready()) return;
+        }
+        for (int i = 0; i < yield_count; i++) {
+            if (ready()) return;
+            std::this_thread::yield();
+        }
+        std::chrono::microseconds sleep{ 1 };
+        while (!ready()) {
+            std::this_thread::sleep_for(sleep);
+            if (sleep < max_sleep) sleep *= 2;
+        }
+    }
+
+    // The size of a cache line, for keeping the two sides' data apart.
+    static constexpr size_t cache_line = 64;
+
+    std::vector<T> items_;
+    size_t mask_ = 0;
+    // The consumer's position (the number of items popped), and its cached copy of tail_.
+    alignas(cache_line) std::atomic<uint64_t> head_ = 0;
+    uint64_t cached_tail_ = 0;
+    // The producer's position (the number of items pushed), and its cached copy of head_.
+    alignas(cache_line) std::atomic<uint64_t> tail_ = 0;
+    uint64_t cached_head_ = 0;
+};
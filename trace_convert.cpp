@@ -0,0 +1,155 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_trace.h"
+#include "input_reader.h"
+#include "output_writer.h"
+#include "packet_parser.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A program that converts traces between the text format (the input of wfq.exe) and the binary format
+// (see binary_trace.h), and converts binary output files of wfq.exe to text:
+//   trace_convert.exe to-binary < trace.txt > trace.bin
+//   trace_convert.exe to-text < trace.bin > trace.txt    (or < output.bin > output.txt)
+// Converting a text trace to binary and back gives the same packets (weights are written with as many digits as needed),
+// and converting the binary output of wfq.exe to text gives exactly its text output.
+
+[[noreturn]] void usage(const char* program) {
+    std::cerr << "usage: " << program << " to-binary|to-text < input > output" << std::endl;
+    std::exit(1);
+}
+
+[[noreturn]] void fail(std::string_view message) {
+    std::cerr << message << std::endl;
+    std::exit(1);
+}
+
+// Returns true if stdout is a regular file that holds exactly the output so far (of the given size) from its start,
+// and isn't opened for appending, so the output can be rewritten in place.
+bool can_rewrite_output(uint64_t size) {
+    std::fflush(stdout);
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) != size) {
+        return false;
+    }
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    return flags != -1 && (flags & O_APPEND) == 0;
+#else
+    return std::ftell(stdout) == static_cast<long>(size);
+#endif
+}
+
+// Converts a text trace to a binary trace. Channel ids are assigned in the order in which connections first appear.
+// The records are written as they are converted. If no packet has an explicit weight, and stdout is a file,
+// the header is rewritten at the end to say so (see BinaryHeader::no_weights).
+void to_binary(InputReader& input) {
+    std::unordered_map<std::string, uint32_t, ConnectionHash, std::equal_to<>> channel_ids;
+    bool has_weights = false;
+    uint64_t size = 0;
+    {
+        OutputWriter output;
+        write_binary_header(output, binary_trace_magic);
+        while (std::optional<std::span<char>> line = input.next_line()) {
+            std::string_view original_line(line->data(), line->size());
+            std::optional<PacketLine> parsed = parse_packet_line(*line);
+            if (!parsed.has_value()) fail("bad input line: " + std::string(original_line));
+            auto [iter, is_new] = channel_ids.emplace(parsed->connection, static_cast<uint32_t>(channel_ids.size()));
+            std::optional<std::string_view> new_connection;
+            if (is_new) new_connection = iter->first;
+            write_binary_record(output,
+                BinaryPacketRecord::make(parsed->time, iter->second, parsed->length, parsed->weight), new_connection);
+            has_weights |= parsed->weight.has_value();
+        }
+        size = output.position();
+    }
+    if (!has_weights && can_rewrite_output(size) && std::fseek(stdout, 0, SEEK_SET) == 0) {
+        BinaryHeader header = make_binary_header(binary_trace_magic, BinaryHeader::no_weights);
+        std::fwrite(&header, sizeof(header), 1, stdout);
+        std::fflush(stdout);
+    }
+}
+
+// Appends a number to a line.
+template <class T>
+void append_number(std::string& line, T value) {
+    char digits[OutputWriter::max_number_length];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    line.append(digits, result.ptr);
+}
+
+// Converts a binary trace, or a binary output file, to text.
+void to_text(InputReader& input) {
+    auto read_bytes = [&input](size_t size) { return input.next_bytes(size); };
+    BinaryHeader header;
+    std::optional<std::vector<std::string>> connections = read_binary_header(read_bytes, header);
+    if (!connections.has_value()) fail("bad binary input: bad header");
+    // Reads the connection after the record, if it is the first record of its channel, and returns it.
+    auto connection_of = [&](const BinaryPacketRecord& record) -> const std::string& {
+        if (!read_binary_record_connection(read_bytes, header, record.channel, *connections)) {
+            fail("bad binary input: bad channel id or truncated connection");
+        }
+        return (*connections)[record.channel];
+    };
+
+    if (header.has_magic(binary_output_magic)) {
+        OutputWriter output;
+        BinaryOutputRecord record;
+        while (read_binary(read_bytes, record)) {
+            output.write_packet(record.transmit_time, record.packet.time, connection_of(record.packet),
+                record.packet.length, record.packet.optional_weight());
+        }
+        return;
+    }
+
+    std::string line;
+    BinaryPacketRecord record;
+    while (read_binary(read_bytes, record)) {
+        line.clear();
+        append_number(line, record.time);
+        line += ' ';
+        line += connection_of(record);
+        line += ' ';
+        append_number(line, record.length);
+        if (std::optional<double> weight = record.optional_weight()) {
+            // The shortest representation that reads back as the same double.
+            line += ' ';
+            append_number(line, *weight);
+        }
+        line += '\n';
+        std::fwrite(line.data(), 1, line.size(), stdout);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) usage(argv[0]);
+    std::string_view command = argv[1];
+    if (command == "to-binary") {
+        set_binary_mode(stdout);
+        InputReader input;
+        to_binary(input);
+    }
+    else if (command == "to-text") {
+        set_binary_mode(stdin);
+        InputReader input;
+        to_text(input);
+    }
+    else {
+        usage(argv[0]);
+    }
+}
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <atomic>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define WFQ_HAVE_IO_URING 1
+#endif
+
+// Asynchronous input and output with io_uring, on Linux (see InputReader::enable_io_uring and
+// OutputWriter::enable_io_uring): the reads of the input are submitted ahead of time, and the writes of the output
+// are submitted without waiting for them, so the thread that parses and schedules packets doesn't stop in read() and
+// write() system calls. The buffers are registered with the kernel once, so each request doesn't have to map them.
+// Where io_uring is not available (other platforms, old kernels, or when it is disabled), nothing here is used.
+
+#ifdef WFQ_HAVE_IO_URING
+
+// A minimal io_uring instance, used through the system calls directly (so there is no dependency on liburing):
+// a submission queue and a completion queue, shared with the kernel through mmap.
+// Only one thread may use an instance.
+class IoUring {
+public:
+    // The completion of a request.
+    struct Completion {
+        // The user_data of the request.
+        uint64_t user_data;
+        // The result of the request: the number of bytes read or written, or -errno.
+        int32_t result;
+    };
+
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+        if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != nullptr) munmap(sq_ring_, sq_ring_size_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Sets up the rings, with room for the given number of requests. Returns false if io_uring is not available,
+    // or if the kernel is too old for reads and writes at the current file position (before Linux 5.6).
+    bool init(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) return false;
+        fd_ = fd;
+        if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) return false;
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == nullptr) return false;
+        cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == nullptr) return false;
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+        if (sqes_ == nullptr) return false;
+
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Registers buffers, so requests can refer to them by their index (see queue). Returns false if the kernel
+    // refused (for example, because of the limit on locked memory); the buffers can still be used without registering.
+    bool register_buffers(const std::vector<iovec>& buffers) {
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers.data(),
+            static_cast<unsigned>(buffers.size())) == 0;
+    }
+
+    // The offset of a request at the current position of its file (which also works for pipes and sockets).
+    static constexpr uint64_t current_position = ~uint64_t(0);
+
+    // Queues a read (IORING_OP_READ or IORING_OP_READ_FIXED) or a write (IORING_OP_WRITE or IORING_OP_WRITE_FIXED)
+    // of size bytes at data, at the given offset of fd. buffer_index is the index of the registered buffer that
+    // contains data, for the _FIXED operations. user_data is returned with the request's completion.
+    // The caller must not have more requests in flight than the ring's entries.
+    void queue(uint8_t opcode, int fd, char* data, uint32_t size, uint16_t buffer_index, uint64_t user_data,
+        uint8_t flags = 0, uint64_t offset = current_position) {
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe& sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.flags = flags;
+        sqe.fd = fd;
+        sqe.off = offset;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = size;
+        sqe.buf_index = buffer_index;
+        sqe.user_data = user_data;
+        sq_array_[index] = index;
+        std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+        to_submit_++;
+    }
+
+    // Submits the queued requests to the kernel. If wait is true, also waits until a completion is available.
+    // Returns false on an error.
+    bool submit(bool wait) {
+        while (true) {
+            long result = syscall(__NR_io_uring_enter, fd_, to_submit_, wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (result >= 0) {
+                to_submit_ -= std::min(to_submit_, static_cast<unsigned>(result));
+                return true;
+            }
+            if (errno != EINTR) return false;
+        }
+    }
+
+    // Returns the next completion, if one is available.
+    std::optional<Completion> next_completion() {
+        unsigned head = *cq_head_;
+        if (head == std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire)) return std::nullopt;
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        Completion result{ cqe.user_data, cqe.res };
+        std::atomic_ref<unsigned>(*cq_head_).store(head + 1, std::memory_order_release);
+        return result;
+    }
+
+    // Submits the queued requests, and waits for the next completion. Returns std::nullopt on an error.
+    std::optional<Completion> wait_completion() {
+        while (true) {
+            if (std::optional<Completion> completion = next_completion()) return completion;
+            if (!submit(true)) return std::nullopt;
+        }
+    }
+
+private:
+    void* map(size_t size, off_t offset) {
+        void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return result == MAP_FAILED ? nullptr : result;
+    }
+
+    int fd_ = -1;
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    // The number of queued requests that were not submitted yet.
+    unsigned to_submit_ = 0;
+};
+
+// Reads a file descriptor ahead into num_buffers buffers of block_size bytes.
+// From a regular file, the reads are at explicit offsets (the next blocks of the file), so all of them are in flight
+// at once. From a pipe or a socket, which has no offsets and where a read may return any amount of data, each read is
+// flagged IOSQE_IO_DRAIN instead, so it only starts when the previous one has ended, at the current position: the reads
+// are serialized, and what is gained is that the next block is read while the caller parses the current one, and that
+// the blocks already read wait in the other buffers.
+// The caller gets the blocks in order (see next_block), and each block is read again as soon as the caller is done
+// with it.
+class UringReader {
+public:
+    static constexpr unsigned num_buffers = 4;
+    static constexpr size_t block_size = 1 << 20;
+    // The room before the data of each block, for the unread end of the previous block (see next_block).
+    static constexpr size_t headroom = 1 << 16;
+
+    UringReader() = default;
+    UringReader(const UringReader&) = delete;
+    UringReader& operator=(const UringReader&) = delete;
+
+    // Starts reading fd. Returns false if io_uring is not available.
+    bool start(int fd) {
+        if (!ring_.init(num_buffers)) return false;
+        fd_ = fd;
+        struct stat st;
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && position >= 0) {
+            seekable_ = true;
+            next_offset_ = read_offset_ = static_cast<uint64_t>(position);
+        }
+        storage_.resize(num_buffers * (headroom + block_size));
+        std::vector<iovec> buffers;
+        for (unsigned i = 0; i < num_buffers; i++) {
+            buffers.push_back({ data(i), block_size });
+        }
+        fixed_ = ring_.register_buffers(buffers);
+        for (unsigned i = 0; i < num_buffers; i++) read(i);
+        return ring_.submit(false);
+    }
+
+    // Waits for the next block of the input, and returns it, with the kept bytes (the unread end of the previous
+    // block, such as a partial line) copied in front of it, so they are contiguous with the new data.
+    // The previous block is then read again. The returned span stays valid until the next call.
+    // Returns std::nullopt at the end of the input (or on an error), and then the previous block stays valid.
+    std::optional<std::span<char>> next_block(std::span<const char> kept) {
+        if (ended_) return std::nullopt;
+        while (true) {
+            while (results_[next_] == pending) {
+                std::optional<IoUring::Completion> completion = ring_.wait_completion();
+                if (!completion.has_value()) {
+                    ended_ = true;
+                    return std::nullopt;
+                }
+                results_[completion->user_data] = completion->result;
+            }
+            // After a short read from a file (which is rare before its end), the reads after it were at the wrong
+            // offsets, so each of them is read again at the offset where the input continues.
+            if (!seekable_ || offsets_[next_] == next_offset_) break;
+            read_offset_ = next_offset_;
+            read(next_);
+            ring_.submit(false);
+        }
+        int result = results_[next_];
+        if (result <= 0) {
+            // Like a blocking read, an error ends the input.
+            ended_ = true;
+            return std::nullopt;
+        }
+        next_offset_ += static_cast<uint64_t>(result);
+        std::span<char> block;
+        if (kept.size() <= headroom) {
+            char* start = data(next_) - kept.size();
+            std::memmove(start, kept.data(), kept.size());
+            block = std::span<char>(start, kept.size() + static_cast<size_t>(result));
+        }
+        else {
+            // A partial line longer than the headroom (which is very rare) is joined in a separate buffer.
+            std::vector<char> joined(kept.begin(), kept.end());
+            joined.insert(joined.end(), data(next_), data(next_) + result);
+            overflow_.swap(joined);
+            block = std::span<char>(overflow_);
+        }
+        if (current_ != none) read(current_);
+        current_ = next_;
+        next_ = (next_ + 1) % num_buffers;
+        if (block.data() == overflow_.data()) {
+            // The block was copied, so its buffer can be read again right away.
+            read(current_);
+            current_ = none;
+        }
+        ring_.submit(false);
+        return block;
+    }
+
+private:
+    static constexpr unsigned none = UINT32_MAX;
+    // The result of a read that has not completed yet.
+    static constexpr int pending = INT32_MIN;
+
+    char* data(unsigned buffer) {
+        return storage_.data() + buffer * (headroom + block_size) + headroom;
+    }
+
+    // Queues a read into a buffer: of the next block of a file, or at the current position of a pipe.
+    void read(unsigned buffer) {
+        results_[buffer] = pending;
+        uint8_t opcode = fixed_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        if (seekable_) {
+            offsets_[buffer] = read_offset_;
+            ring_.queue(opcode, fd_, data(buffer), block_size, static_cast<uint16_t>(buffer), buffer, 0, read_offset_);
+            read_offset_ += block_size;
+        }
+        else {
+            ring_.queue(opcode, fd_, data(buffer), block_size, static_cast<uint16_t>(buffer), buffer, IOSQE_IO_DRAIN);
+        }
+    }
+
+    // The buffers are declared before the ring, so the ring is closed (and its reads are cancelled) first.
+    std::vector<char> storage_;
+    std::vector<char> overflow_;
+    IoUring ring_;
+    int fd_ = -1;
+    // True if the buffers are registered.
+    bool fixed_ = false;
+    // True if fd is a regular file, which is read at explicit offsets.
+    bool seekable_ = false;
+    // For a regular file: the offset of the next read to queue, the offset of the input after the last block returned,
+    // and the offset of the last read of each buffer.
+    uint64_t read_offset_ = 0;
+    uint64_t next_offset_ = 0;
+    uint64_t offsets_[num_buffers] = {};
+    // The result of the last read of each buffer (the number of bytes read, 0 at the end, or -errno), or pending.
+    int results_[num_buffers] = {};
+    // The buffer of the next block, and the buffer of the block the caller is reading (or none).
+    unsigned next_ = 0;
+    unsigned current_ = none;
+    bool ended_ = false;
+};
+
+// Writes to a file descriptor without waiting for the writes: write() copies the data to free buffers, and submits
+// them, and only waits when all num_buffers buffers are queued. The buffers are written one at a time, in order (only
+// one write is in flight), so a short write (which a pipe or a socket may do) is continued before the next buffer.
+class UringWriter {
+public:
+    static constexpr unsigned num_buffers = 4;
+    static constexpr size_t buffer_size = 1 << 17;
+
+    UringWriter() = default;
+    UringWriter(const UringWriter&) = delete;
+    UringWriter& operator=(const UringWriter&) = delete;
+
+    ~UringWriter() {
+        finish();
+    }
+
+    // Starts writing to fd. Returns false if io_uring is not available.
+    bool start(int fd) {
+        if (!ring_.init(num_buffers)) return false;
+        fd_ = fd;
+        storage_.resize(num_buffers * buffer_size);
+        std::vector<iovec> buffers;
+        for (unsigned i = 0; i < num_buffers; i++) {
+            buffers.push_back({ storage_.data() + i * buffer_size, buffer_size });
+        }
+        fixed_ = ring_.register_buffers(buffers);
+        return true;
+    }
+
+    // Writes data (copying it, so it may be reused right away). Waits only if all the buffers are in use.
+    void write(std::span<const char> data) {
+        while (!data.empty()) {
+            // A short write is continued in the same buffer, so this may take more than one completion.
+            while (queued_ == num_buffers) complete(true);
+            unsigned buffer = (first_ + queued_) % num_buffers;
+            size_t size = std::min(data.size(), buffer_size);
+            std::memcpy(storage_.data() + buffer * buffer_size, data.data(), size);
+            sizes_[buffer] = size;
+            queued_++;
+            data = data.subspan(size);
+            if (queued_ == 1) submit_first();
+        }
+        // Take the completions that are already available, and submit the next buffers.
+        while (queued_ != 0 && complete(false)) {}
+    }
+
+    // Waits until all the buffers that were written, except for the one being written, are submitted,
+    // so the output doesn't wait for the next call to get to the kernel.
+    void submit_all() {
+        while (queued_ > 1) complete(true);
+    }
+
+    // Waits until all the data has been written.
+    void finish() {
+        while (queued_ != 0) complete(true);
+    }
+
+private:
+    // Submits the rest of the first queued buffer.
+    void submit_first() {
+        char* data = storage_.data() + first_ * buffer_size;
+        ring_.queue(fixed_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd_, data + written_,
+            static_cast<uint32_t>(sizes_[first_] - written_), static_cast<uint16_t>(first_), first_);
+        if (!ring_.submit(false)) fail();
+    }
+
+    // Takes the completion of the first queued buffer (waiting for it if wait is true), and submits the next one.
+    // Returns false if it had not completed yet.
+    bool complete(bool wait) {
+        std::optional<IoUring::Completion> completion = wait ? ring_.wait_completion() : ring_.next_completion();
+        if (!completion.has_value()) {
+            if (wait) fail();
+            return false;
+        }
+        if (completion->result == -EINTR || completion->result == -EAGAIN) {
+            submit_first();
+            return true;
+        }
+        if (completion->result <= 0) {
+            // Like fwrite, the output is lost if it can't be written (for example, if the reader of a pipe exited).
+            fail();
+            return true;
+        }
+        written_ += static_cast<size_t>(completion->result);
+        if (written_ == sizes_[first_]) {
+            written_ = 0;
+            first_ = (first_ + 1) % num_buffers;
+            queued_--;
+        }
+        if (queued_ != 0) submit_first();
+        return true;
+    }
+
+    // Drops all the queued data.
+    void fail() {
+        queued_ = 0;
+        written_ = 0;
+    }
+
+    // The buffers are declared before the ring, so the ring is closed (and its writes are cancelled) first.
+    std::vector<char> storage_;
+    IoUring ring_;
+    int fd_ = -1;
+    // True if the buffers are registered.
+    bool fixed_ = false;
+    // The number of bytes in each buffer.
+    size_t sizes_[num_buffers] = {};
+    // The queued buffers are first_, first_ + 1, ... (modulo num_buffers); only the first one is in flight.
+    unsigned first_ = 0;
+    unsigned queued_ = 0;
+    // The number of bytes of the first buffer that were already written.
+    size_t written_ = 0;
+};
+
+#endif
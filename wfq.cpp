@@ -1,222 +1,1460 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <optional>
 #include <vector>
 #include <queue>
 #include <unordered_map>
-#include <format>
 #include <iomanip>
 #include <limits>
 #include <string>
 #include <functional>
 #include <cassert>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <variant>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "binary_trace.h"
+#include "calendar_queue.h"
+#include "checkpoint.h"
+#include "dary_heap.h"
+#include "flow_key.h"
+#include "flow_table.h"
+#include "hierarchical_scheduler.h"
+#include "input_reader.h"
+#include "log_histogram.h"
+#include "output_writer.h"
+#include "packet_parser.h"
+#include "parallel_parser.h"
+#include "phase_timer.h"
+#include "spsc_ring.h"
+#include "wfq_scheduler.h"
 
 // A program that implements a Weighted Fair Queueing (WFQ) algorithm for packet scheduling.
 
-// Virtual time, which is used to calculate the priority of channels.
-double virtual_time = 0;
+// The field of a connection ("sadd sport dadd dport") that chooses its shard, with --shards.
+// The values are the indices of the fields.
+enum class ShardBy { src_addr, src_port, dst_addr, dst_port, connection };
+
+// Command line options.
+struct Options {
+    // Look up IPv4 and IPv6 connections by packed binary keys (see flow_key.h and flow_table.h), instead of by their text.
+    bool packed_keys = false;
+    // Run the reader, the scheduler and the writer in separate threads (see Pipeline).
+    bool pipelined = false;
+    // If not 0, parse the whole input in advance with this many threads (see parse_input_in_parallel).
+    unsigned parse_threads = 0;
+    // If not 0, schedule this many independent output links, in separate threads (see Shard).
+    unsigned shards = 0;
+    // The field of the connection that chooses the shard of a packet.
+    ShardBy shard_by = ShardBy::dst_addr;
+    // Read the input, and write the output, in the binary format (see binary_trace.h) instead of text.
+    bool binary_input = false;
+    bool binary_output = false;
+    // Queue limits, the drop policy, and eviction of idle channels (--max-queue, --max-packets, --drop-policy and
+    // --streaming), for running on unbounded input with bounded memory.
+    WfqLimits limits;
+    // When the weight of a packet changes the weight of its channel (--immediate-weights, see WeightUpdate).
+    WeightUpdate weight_update = WeightUpdate::next_packet;
+    // Record the queueing delay of each channel's packets, and the number of active channels, and report them at exit
+    // (see LatencyStats).
+    bool latency_stats = false;
+    // Use the unweighted scheduler (see Scheduler), for traces where no packet has an explicit weight.
+    // Set by --unweighted, or up front when the input is known to have no weights: a binary trace whose header says so
+    // (see BinaryHeader::no_weights), or an input parsed in advance (with --parse-threads) that has none.
+    bool unweighted = false;
+    // Read the input and write the text output with io_uring, where it is available (see uring_io.h).
+    bool io_uring = false;
+    // If not empty, write a checkpoint of the state to this file every checkpoint_interval packets of input
+    // (see Scheduler::save_checkpoint), and resume from the checkpoint in resume_path (see start_resume).
+    std::string checkpoint_path;
+    uint64_t checkpoint_interval = 1000000;
+    std::string resume_path;
+    // If not 0, schedule hierarchically (see HierarchicalWfqScheduler): the channels are grouped into classes by the
+    // first class_prefix fields of their connections (1 to 3: the source address, and then the source port and the
+    // destination address), and the link is shared between the classes by their weights, which are read from
+    // class_weights_path (see read_class_weights), or are 1.
+    unsigned class_prefix = 0;
+    std::string class_weights_path;
+};
+Options options;
+
+// The writer for stdout.
+OutputWriter output;
 
-// Information about a packet: arrival time, connection, length, and weight.
+// Information about a packet: arrival time, channel, length, and weight.
 class PacketInfo {
 public:
     // The time when the packet arrived.
     uint64_t time = 0;
-    // The packet's connection (source IP, source port, destination IP, destination port).
-    std::string connection = "";
     // The packet's length.
     uint64_t length = 0;
     // The packet's weight, if written explicitly.
     std::optional<double> weight;
+    // The id of the packet's channel (see intern_connection).
+    uint32_t channel = 0;
+
+    // Writes the packet to the output, as transmitted at the given time.
+    // connection is the connection string of the packet's channel.
+    void write(OutputWriter& writer, uint64_t transmit_time, std::string_view connection) const {
+        writer.write_packet(transmit_time, time, connection, length, weight);
+    }
+};
+
+// A packet read from the input, whose connection has been interned (see intern_connection),
+// but which has not been added to its channel yet.
+struct InputPacket {
+    PacketInfo packet;
+    // If the packet's connection was seen for the first time, its connection string (a view into channel_ids or
+    // keyed_connections, which stays valid). The scheduler creates the packet's channel when it sees this packet.
+    std::string_view new_connection;
+};
+
+void finish_output();
+
+// Reports an error in the input, and aborts.
+[[noreturn]] void input_error(std::string_view message) {
+    // Everything before the error is still written.
+    finish_output();
+    std::cerr << message << std::endl;
+    std::abort();
+}
+
+// The error message for a line that did not contain exactly 6 or 7 parameters.
+std::string bad_line_message(std::string_view line) {
+    return "bad input line: " + std::string(line);
+}
+
+// Reports a bad input line, and aborts.
+[[noreturn]] void bad_input_line(std::string_view line) {
+    input_error(bad_line_message(line));
+}
+
+// Reads a packet line. The line may be modified in place (see parse_packet_line).
+PacketLine parse_line(std::span<char> input_line) {
+    std::string_view original_line(input_line.data(), input_line.size());
+    std::optional<PacketLine> parsed = parse_packet_line(input_line);
+    if (!parsed.has_value()) {
+        // If the input line did not contain exactly 6 or 7 parameters, that's an error.
+        bad_input_line(original_line);
+    }
+    return *parsed;
+}
+
+// A map that maps connection strings (source ip, source port, destination ip, destination port) to channel ids.
+// Each connection is interned here once, the first time it is seen.
+std::unordered_map<std::string, uint32_t, ConnectionHash, std::equal_to<>> channel_ids;
+// With --packed-keys, maps the keys of IPv4 and IPv6 connections to channel ids.
+// Connections that have no key (see flow_key.h) are still looked up in channel_ids.
+FlowTable<Ipv4FlowKey> ipv4_channel_ids;
+FlowTable<Ipv6FlowKey> ipv6_channel_ids;
+// The connection strings of the channels in ipv4_channel_ids and ipv6_channel_ids, which are only used for output.
+std::deque<std::string> keyed_connections;
+// The number of connections interned so far, which is also the next channel id.
+uint32_t num_connections = 0;
+// The connection of each channel id.
+std::vector<std::string_view> connection_names;
+// The reader for stdin.
+InputReader input;
+
+// Get the channel id of a connection from one of the tables of packed keys, or assign it a new id.
+template <class Key>
+uint32_t intern_keyed_connection(FlowTable<Key>& table, const Key& key, std::string_view connection,
+    std::string_view& new_connection) {
+    auto [id, inserted] = table.find_or_insert(key, num_connections);
+    if (inserted) {
+        num_connections++;
+        // Keep the connection string for output.
+        new_connection = keyed_connections.emplace_back(connection);
+        connection_names.push_back(new_connection);
+    }
+    return id;
+}
+
+// Get the channel id of a connection from channel_ids, or assign it a new id if it wasn't seen before.
+// Channel ids are assigned in the order in which connections first appear in the input.
+// If the connection is new, sets new_connection to a copy of it that stays valid.
+uint32_t intern_connection(std::string_view connection, std::string_view& new_connection) {
+    if (options.packed_keys) {
+        FlowKey key = FlowKey::parse(connection);
+        if (key.ipv4.has_value()) return intern_keyed_connection(ipv4_channel_ids, *key.ipv4, connection, new_connection);
+        if (key.ipv6.has_value()) return intern_keyed_connection(ipv6_channel_ids, *key.ipv6, connection, new_connection);
+    }
+    auto iter = channel_ids.find(connection);
+    // If the connection already has an id, return it.
+    if (iter != channel_ids.end()) return iter->second;
+    // If the connection is not in the map, add it.
+    auto iter_and_bool = channel_ids.emplace(std::string(connection), num_connections++);
+    new_connection = iter_and_bool.first->first;
+    connection_names.push_back(new_connection);
+    return iter_and_bool.first->second;
+}
+
+// Interns the connection of a parsed line, and returns the parsed packet.
+InputPacket intern_packet(const PacketLine& line) {
+    InputPacket result{ .packet = { .time = line.time, .length = line.length, .weight = line.weight }, .new_connection = {} };
+    result.packet.channel = intern_connection(line.connection, result.new_connection);
+    return result;
+}
+
+// With --class-prefix, maps the key of each class (see class_key) to its id. Class ids, like channel ids,
+// are assigned in the order in which classes first appear in the input.
+std::unordered_map<std::string, uint32_t, ConnectionHash, std::equal_to<>> class_ids;
+// The weights of the classes that were given in the --class-weights file, by their keys.
+std::unordered_map<std::string, double, ConnectionHash, std::equal_to<>> class_weights;
 
-    // Implementation of printing for PacketInfo.
-    friend std::ostream& operator<<(std::ostream& os, const PacketInfo& self) {
-        if (self.weight.has_value()) {
-            return os << std::format("{} {} {} {:.2f}", self.time, self.connection, self.length, *self.weight);
+// Returns the key of a connection's class: its first options.class_prefix fields.
+std::string_view class_key(std::string_view connection) {
+    size_t end = 0;
+    for (unsigned i = 0; i < options.class_prefix; i++) {
+        end = connection.find(' ', i == 0 ? 0 : end + 1);
+        if (end == std::string_view::npos) return connection;
+    }
+    return connection.substr(0, end);
+}
+
+// Get the class id of a connection, or assign it a new id if its class wasn't seen before.
+// If the class is new, sets new_class_weight to its weight.
+uint32_t intern_class(std::string_view connection, std::optional<double>& new_class_weight) {
+    std::string_view key = class_key(connection);
+    auto iter = class_ids.find(key);
+    if (iter != class_ids.end()) return iter->second;
+    auto weight = class_weights.find(key);
+    new_class_weight = weight != class_weights.end() ? weight->second : 1.0;
+    uint32_t id = static_cast<uint32_t>(class_ids.size());
+    class_ids.emplace(std::string(key), id);
+    return id;
+}
+
+// Reads the weights of the classes (--class-weights) from a file with a line for each class: its key (the first
+// options.class_prefix fields of its connections), and then its weight, such as "10.0.0.1 2.5" with --class-prefix 1.
+// Empty lines are skipped. Exits with an error message if the file can't be read, or if a line is not valid.
+void read_class_weights(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "can't read the class weights " << path << std::endl;
+        std::exit(1);
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::vector<std::string> tokens;
+        std::string token;
+        while (fields >> token) tokens.push_back(token);
+        if (tokens.empty()) continue;
+        char* end = nullptr;
+        double weight = tokens.size() == options.class_prefix + 1 ? std::strtod(tokens.back().c_str(), &end) : 0;
+        if (end == nullptr || *end != '\0' || !(weight > 0)) {
+            std::cerr << "bad class weights line: " << line << std::endl;
+            std::exit(1);
         }
-        else {
-            return os << self.time << " " << self.connection << " " << self.length;
+        std::string key = tokens[0];
+        for (unsigned i = 1; i < options.class_prefix; i++) key += " " + tokens[i];
+        class_weights[key] = weight;
+    }
+}
+
+// The state of reading a binary trace (with --input-format binary).
+struct BinaryInput {
+    // A channel id of a connection that wasn't seen yet.
+    static constexpr uint32_t no_channel = UINT32_MAX;
+
+    // The trace's header.
+    BinaryHeader header;
+    // The connections of the trace's channel ids (the ones read so far, or a version 1 trace's table).
+    std::vector<std::string> connections;
+    // The channel id (see intern_connection) of each entry of connections, or no_channel.
+    // The connections are interned the first time a packet uses them, so channel ids are always assigned in the order
+    // in which connections first appear, even if the trace's table is in a different order.
+    std::vector<uint32_t> channels;
+};
+BinaryInput binary_input;
+
+// Reads the header of a binary trace from stdin, before any packet is read (so the header can choose the scheduler,
+// see Options::unweighted). Reports an error if the input is not a binary trace.
+void start_binary_input() {
+    auto read_bytes = [](size_t size) { return input.next_bytes(size); };
+    BinaryHeader& header = binary_input.header;
+    std::optional<std::vector<std::string>> connections = read_binary_header(read_bytes, header);
+    if (!connections.has_value() || !header.has_magic(binary_trace_magic)) {
+        input_error("bad binary input: not a binary trace");
+    }
+    binary_input.connections = std::move(*connections);
+    binary_input.channels.assign(binary_input.connections.size(), BinaryInput::no_channel);
+    if ((header.flags & BinaryHeader::no_weights) != 0) options.unweighted = true;
+}
+
+// Reads the next packet of a binary trace from stdin (after start_binary_input), and interns its connection.
+// Returns std::nullopt at the end of the input. If the input is not a valid binary trace,
+// sets error to a message (instead of reporting it, so it can be called by the reader thread) and returns std::nullopt.
+std::optional<InputPacket> read_binary_packet(std::string& error) {
+    std::span<char> bytes = input.next_bytes(sizeof(BinaryPacketRecord));
+    if (bytes.empty()) return std::nullopt;
+    BinaryPacketRecord record;
+    if (bytes.size() != sizeof(record)) {
+        error = "bad binary input: truncated record";
+        return std::nullopt;
+    }
+    std::memcpy(&record, bytes.data(), sizeof(record));
+    // The first record of a channel is followed by its connection (except in version 1).
+    auto read_bytes = [](size_t size) { return input.next_bytes(size); };
+    size_t num_known = binary_input.connections.size();
+    if (!read_binary_record_connection(read_bytes, binary_input.header, record.channel, binary_input.connections)) {
+        bool truncated = record.channel == num_known && binary_input.header.version != binary_table_version;
+        error = truncated ? "bad binary input: truncated connection" :
+            "bad binary input: bad channel id " + std::to_string(record.channel);
+        return std::nullopt;
+    }
+    binary_input.channels.resize(binary_input.connections.size(), BinaryInput::no_channel);
+    InputPacket result{ .packet = { .time = record.time, .length = record.length, .weight = record.optional_weight() },
+        .new_connection = {} };
+    uint32_t& channel = binary_input.channels[record.channel];
+    if (channel == BinaryInput::no_channel) {
+        channel = intern_connection(binary_input.connections[record.channel], result.new_connection);
+    }
+    result.packet.channel = channel;
+    return result;
+}
+
+// Reads the next packet from stdin. Returns std::nullopt at the end of the input.
+std::optional<InputPacket> read_input_packet() {
+    WFQ_PHASE(parse);
+    if (options.binary_input) {
+        std::string error;
+        std::optional<InputPacket> packet = read_binary_packet(error);
+        if (!error.empty()) input_error(error);
+        return packet;
+    }
+    std::optional<std::span<char>> line = input.next_line();
+    if (!line.has_value()) return std::nullopt;
+    PacketLine parsed = parse_line(*line);
+    WFQ_PHASE(lookup);
+    return intern_packet(parsed);
+}
+
+// The writer for the binary output (with --output-format binary).
+BinaryOutputWriter<OutputWriter> binary_output{ output };
+
+// Writes a transmitted packet to the output, in the output format.
+// Called by the thread that writes the output.
+void output_packet(uint64_t transmit_time, const PacketInfo& packet, std::string_view connection) {
+    if (options.binary_output) {
+        binary_output.write_packet(transmit_time, packet.time, packet.channel, connection, packet.length,
+            packet.weight);
+    }
+    else {
+        packet.write(output, transmit_time, connection);
+    }
+}
+
+// Writes the output so far to stdout. If end is true, there is no more output.
+void flush_stdout(bool end) {
+    if (end) output.finish();
+    else output.flush();
+}
+
+// The pipelined mode (--pipelined) runs in three threads, connected by lock-free SpscRing's:
+// the reader thread reads and parses the input lines and interns their connections,
+// the main thread runs the scheduler (the loop in main), and the writer thread formats and writes the output.
+// The scheduler takes packets from the reader's ring the same way it would read them from stdin (one packet ahead,
+// through next_packet), so packets are still only added to their channels up to the current link time,
+// and the output is exactly the same as in the normal mode.
+class Pipeline {
+public:
+    // The number of items in each ring.
+    static constexpr size_t ring_size = 1 << 16;
+
+    // Starts the reader and writer threads.
+    void start() {
+        reader_ = std::thread([this] { run_reader(); });
+        writer_ = std::thread([this] { run_writer(); });
+    }
+
+    // Returns the next packet from the reader. Returns std::nullopt at the end of the input.
+    std::optional<InputPacket> next_input_packet() {
+        // The reader pushes nothing after the end of the input.
+        if (input_ended_) return std::nullopt;
+        InputItem item = input_ring_.pop();
+        if (item.kind == InputItem::Kind::packet) return item.packet;
+        input_ended_ = true;
+        reader_.join();
+        if (item.kind == InputItem::Kind::error) input_error(error_);
+        return std::nullopt;
+    }
+
+    // Sends a transmitted packet to the writer.
+    void write_packet(uint64_t transmit_time, const PacketInfo& packet, std::string_view connection) {
+        output_ring_.push({ OutputItem::Kind::packet, transmit_time, packet, connection });
+    }
+
+    // Tells the writer to flush its output.
+    void flush() {
+        output_ring_.push({ OutputItem::Kind::flush, 0, {}, {} });
+    }
+
+    // Tells the writer to finish, and waits until it has written all the output.
+    void finish() {
+        if (!writer_.joinable()) return;
+        output_ring_.push({ OutputItem::Kind::end, 0, {}, {} });
+        writer_.join();
+    }
+
+private:
+    // An item passed from the reader to the scheduler.
+    struct InputItem {
+        enum class Kind : uint8_t { packet, end, error };
+        Kind kind = Kind::packet;
+        InputPacket packet;
+    };
+
+    // An item passed from the scheduler to the writer.
+    struct OutputItem {
+        enum class Kind : uint8_t { packet, flush, end };
+        Kind kind = Kind::packet;
+        uint64_t transmit_time = 0;
+        PacketInfo packet;
+        std::string_view connection;
+    };
+
+    void run_reader() {
+        if (options.binary_input) {
+            while (std::optional<InputPacket> packet = read_binary_packet(error_)) {
+                input_ring_.push({ InputItem::Kind::packet, *packet });
+            }
+            input_ring_.push({ error_.empty() ? InputItem::Kind::end : InputItem::Kind::error, {} });
+            return;
+        }
+        while (std::optional<std::span<char>> line = input.next_line()) {
+            std::string_view original_line(line->data(), line->size());
+            std::optional<PacketLine> parsed = parse_packet_line(*line);
+            if (!parsed.has_value()) {
+                // The scheduler reports the bad line when it gets to it, after the packets before it.
+                error_ = bad_line_message(original_line);
+                input_ring_.push({ InputItem::Kind::error, {} });
+                return;
+            }
+            input_ring_.push({ InputItem::Kind::packet, intern_packet(*parsed) });
         }
+        input_ring_.push({ InputItem::Kind::end, {} });
     }
 
-    // Reads a PacketInfo from a string.
-    static PacketInfo parse(const char* input_line) {
-        PacketInfo result;
-        char sadd[32], sport[32], dadd[32], dport[32];
-        double weight;
-        int num_read = sscanf(
-            input_line,
-            "%llu %31s %31s %31s %31s %llu %lf",
-            &result.time, sadd, sport, dadd, dport, &result.length, &weight
-        );
-        result.connection = std::format("{} {} {} {}", sadd, sport, dadd, dport);
-        if (num_read == 6) {
-            result.weight = std::nullopt;
+    void run_writer() {
+        while (true) {
+            OutputItem item = output_ring_.pop();
+            if (item.kind == OutputItem::Kind::packet) {
+                output_packet(item.transmit_time, item.packet, item.connection);
+            }
+            else {
+                flush_stdout(item.kind == OutputItem::Kind::end);
+                if (item.kind == OutputItem::Kind::end) return;
+            }
         }
-        else if (num_read == 7) {
-            result.weight = weight;
+    }
+
+    SpscRing<InputItem> input_ring_{ ring_size };
+    SpscRing<OutputItem> output_ring_{ ring_size };
+    std::thread reader_;
+    std::thread writer_;
+    // Whether the scheduler got the end of the input (or an error).
+    bool input_ended_ = false;
+    // The error message, if the reader found an error in the input (written before the error item is pushed).
+    std::string error_;
+};
+Pipeline pipeline;
+
+// The input, parsed in advance by parse_input_in_parallel.
+struct ParsedInput {
+    // The packets of the input, in order, with their connections already interned.
+    std::vector<InputPacket> packets;
+    // The index of the next packet to give to the scheduler.
+    size_t next = 0;
+    // The first bad line of the input, if any. It is reported when the scheduler gets to it.
+    std::optional<std::string_view> bad_line;
+    // True if any of the packets has an explicit weight.
+    bool has_weights = false;
+};
+std::optional<ParsedInput> parsed_input;
+
+// Parses the whole input in parallel with parse_in_parallel (see parallel_parser.h), and then interns the connections
+// in a single pass over the chunks, in order, so channel ids are still assigned in the order of first appearance.
+// The scheduler then only has to take the packets from parsed_input. If none of them has an explicit weight,
+// the unweighted scheduler is used (see Options::unweighted).
+// Does nothing if the input is not memory-mapped (for example, if it is a pipe); it is then read serially.
+void parse_input_in_parallel(unsigned num_threads) {
+    std::optional<std::span<char>> data = input.take_mapped_input();
+    if (!data.has_value()) return;
+    WFQ_PHASE(parse);
+    std::vector<ParsedChunk> chunks = parse_in_parallel(*data, num_threads);
+    WFQ_PHASE(lookup);
+    ParsedInput result;
+    size_t num_packets = 0;
+    for (const ParsedChunk& chunk : chunks) num_packets += chunk.packets.size();
+    result.packets.reserve(num_packets);
+    for (ParsedChunk& chunk : chunks) {
+        for (const PacketLine& line : chunk.packets) {
+            result.packets.push_back(intern_packet(line));
+            result.has_weights |= line.weight.has_value();
         }
-        else {
-            // If the input line did not contain exactly 6 or 7 parameters, that's an error.
-            std::cerr << "bad input line: " << input_line << std::endl;
-            std::abort();
+        // The chunk's packets are no longer needed.
+        std::vector<PacketLine>().swap(chunk.packets);
+        if (chunk.bad_line.has_value()) {
+            // The rest of the input is never read.
+            result.bad_line = chunk.bad_line;
+            break;
         }
-        return result;
     }
+    if (!result.has_weights) options.unweighted = true;
+    parsed_input = std::move(result);
+}
+
+// Returns the next packet from the input (from stdin, from the reader thread in the pipelined mode,
+// or from parsed_input if it was parsed in advance). Returns std::nullopt at the end of the input.
+std::optional<InputPacket> next_input_packet() {
+    std::optional<InputPacket> packet;
+    if (!parsed_input.has_value()) {
+        packet = options.pipelined ? pipeline.next_input_packet() : read_input_packet();
+    }
+    else if (parsed_input->next < parsed_input->packets.size()) {
+        packet = std::move(parsed_input->packets[parsed_input->next++]);
+    }
+    else if (parsed_input->bad_line.has_value()) {
+        bad_input_line(*parsed_input->bad_line);
+    }
+    // The unweighted scheduler would ignore the weight, so a weighted packet is an error.
+    if (options.unweighted && packet.has_value() && packet->packet.weight.has_value()) {
+        input_error("weighted packet in an unweighted trace, at time " + std::to_string(packet->packet.time));
+    }
+    return packet;
+}
+
+// Writes a transmitted packet to the output (directly, or through the writer thread in the pipelined mode).
+void write_packet(uint64_t transmit_time, const PacketInfo& packet, std::string_view connection) {
+    if (options.pipelined) pipeline.write_packet(transmit_time, packet, connection);
+    else output_packet(transmit_time, packet, connection);
+}
+
+// Flushes the output.
+void flush_output() {
+    if (options.pipelined) pipeline.flush();
+    else flush_stdout(false);
+}
+
+void finish_shards(bool stop);
+
+// The total number of packets (and bytes) dropped by all the schedulers.
+uint64_t dropped_packets = 0;
+uint64_t dropped_bytes = 0;
+
+// Reports the number of dropped packets to stderr, if there are queue limits.
+void report_drops() {
+    if (options.limits.max_channel_packets == 0 && options.limits.max_packets == 0) return;
+    std::cerr << "dropped packets: " << dropped_packets << std::endl;
+    std::cerr << "dropped bytes: " << dropped_bytes << std::endl;
+}
+
+// Latency statistics (--latency-stats): a histogram of the queueing delays (transmit time minus arrival time) of the
+// packets of each channel, and a histogram of the number of active channels while the link is busy, weighted by time
+// (each packet's transmission time is counted for the number of active channels when it was chosen).
+// The histograms have a fixed size (about 2 KiB per channel), so recording never allocates.
+struct LatencyStats {
+    using ChannelHistogram = LogHistogram<uint32_t, 3>;
+    using ActiveChannelsHistogram = LogHistogram<uint64_t, 4>;
+
+    // The histogram of each channel, indexed by its id.
+    std::vector<ChannelHistogram> channels;
+    ActiveChannelsHistogram active_channels;
 };
+// The statistics of all the schedulers, by channel id (see intern_connection).
+LatencyStats latency_stats;
 
-// An object that contains information about a channel.
-// A channel is defined by its index, weight, and a queue of packets that are waiting to be transmitted on this channel.
-class ChannelInfo {
-public:
-    // The channel's index in the input.
-    uint64_t index = 0;
-    // The channel's weight.
-    double weight = 1.0;
-	// Last finish time of the channel.
-    double last_finish_time = 0;
-	// A flag that indicates whether the channel is currently active (has packets ready to send).
-    bool is_active = false;
-    // A queue of packets that are waiting to be transmitted on this channel.
-    std::queue<PacketInfo> Q = {};
+// Reports latency_stats to stderr, if --latency-stats was given.
+void report_latency() {
+    if (!options.latency_stats) return;
+    std::cerr << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < latency_stats.channels.size(); i++) {
+        const LatencyStats::ChannelHistogram& histogram = latency_stats.channels[i];
+        if (histogram.total() == 0) continue;
+        std::cerr << "latency " << connection_names[i] << ": packets " << histogram.total()
+            << " mean " << histogram.mean() << " p50 " << histogram.quantile(0.5) << " p90 " << histogram.quantile(0.9)
+            << " p99 " << histogram.quantile(0.99) << " max " << histogram.max() << std::endl;
+    }
+    const LatencyStats::ActiveChannelsHistogram& active = latency_stats.active_channels;
+    std::cerr << "active channels: mean " << active.mean() << " p50 " << active.quantile(0.5)
+        << " p90 " << active.quantile(0.9) << " p99 " << active.quantile(0.99) << " max " << active.max() << std::endl;
+}
+
+// Writes all the output so far to stdout, and waits until it is written.
+// In the pipelined mode, this stops the writer thread, and in the sharded mode it stops the shards,
+// so nothing may be written afterwards.
+void finish_output() {
+    if (options.pipelined) pipeline.finish();
+    else if (options.shards != 0) finish_shards(true);
+    else flush_stdout(true);
+}
+
+// Returns the flags of the options that the state depends on, for a checkpoint (see CheckpointHeader).
+uint32_t checkpoint_flags() {
+    uint32_t flags = 0;
+    if (options.unweighted) flags |= CheckpointHeader::unweighted;
+#ifdef WFQ_FIXED_POINT
+    // Unweighted traces always use the same clock.
+    if (!options.unweighted) flags |= CheckpointHeader::fixed_point;
+#endif
+    if (options.binary_input) flags |= CheckpointHeader::binary_input;
+    if (options.weight_update == WeightUpdate::immediate) flags |= CheckpointHeader::immediate_weights;
+    if (options.limits.evict_idle_channels) flags |= CheckpointHeader::evict_idle_channels;
+    if (options.limits.drop_policy == DropPolicy::longest) flags |= CheckpointHeader::drop_longest;
+    return flags;
+}
+
+// Reads the records of a binary trace up to an offset (see InputReader::offset), for resuming from a checkpoint:
+// the connections are only written after the first record of each channel (except in version 1, whose connection
+// table has already been read), so the ones before the offset have to be read to know all the channel ids.
+// Returns false if the input ends before the offset, or is not valid.
+bool read_binary_connections_to(uint64_t offset) {
+    if (binary_input.header.version == binary_table_version) return true;
+    auto read_bytes = [](size_t size) { return input.next_bytes(size); };
+    BinaryPacketRecord record;
+    while (input.offset() < offset) {
+        if (!read_binary(read_bytes, record) ||
+            !read_binary_record_connection(read_bytes, binary_input.header, record.channel, binary_input.connections)) {
+            return false;
+        }
+    }
+    binary_input.channels.resize(binary_input.connections.size(), BinaryInput::no_channel);
+    return input.offset() == offset;
+}
+
+// The checkpoint to resume from (with --resume).
+CheckpointReader resume_checkpoint;
+
+// Opens the checkpoint to resume from (with --resume), and restores the state outside of the scheduler, which then
+// restores its own (see Scheduler::restore): the connections are interned again, in the order of their ids
+// (so the channel ids are the same), the input is skipped up to the checkpoint's offset, and the output continues
+// from the checkpoint's position (see OutputWriter::resume_at). The scheduler variant is the checkpoint's.
+// Reports an error if the checkpoint is not valid, if it was written with other options, or if the input is shorter.
+void start_resume() {
+    if (!resume_checkpoint.open(options.resume_path)) input_error("bad checkpoint: " + options.resume_path);
+    const CheckpointHeader& header = resume_checkpoint.header();
+    options.unweighted = (header.flags & CheckpointHeader::unweighted) != 0;
+    if ((header.flags & ~CheckpointHeader::has_next_packet) != checkpoint_flags() ||
+        header.max_channel_packets != options.limits.max_channel_packets ||
+        header.max_packets != options.limits.max_packets) {
+        input_error("the checkpoint " + options.resume_path + " was written with different options");
+    }
+    for (std::string_view connection : resume_checkpoint.connections()) {
+        std::string_view new_connection;
+        intern_connection(connection, new_connection);
+        if (new_connection.empty()) input_error("bad checkpoint: repeated connection " + std::string(connection));
+    }
+    if (options.binary_input && !read_binary_connections_to(header.input_offset)) {
+        input_error("the input ends before the offset of the checkpoint " + options.resume_path);
+    }
+    if (options.binary_input) {
+        // The entries of the trace's connections that the checkpointed run had already used.
+        std::unordered_map<std::string_view, uint32_t> ids;
+        for (uint32_t id = 0; id < connection_names.size(); id++) ids.emplace(connection_names[id], id);
+        for (size_t i = 0; i < binary_input.connections.size(); i++) {
+            auto iter = ids.find(binary_input.connections[i]);
+            if (iter != ids.end()) binary_input.channels[i] = iter->second;
+        }
+    }
+    if (!input.skip_to(header.input_offset)) {
+        input_error("the input ends before the offset of the checkpoint " + options.resume_path);
+    }
+    output.resume_at(header.output_position);
+}
+
+// The representation of virtual times, for weighted traces (unweighted traces always use UnweightedVirtualClock).
+// Compile with -DWFQ_FIXED_POINT to use fixed-point virtual times (see FixedPointVirtualClock) instead of doubles.
+#ifdef WFQ_FIXED_POINT
+using VirtualClock = FixedPointVirtualClock;
+#else
+using VirtualClock = DoubleVirtualClock;
+#endif
+
+// The priority queue of active channels, for virtual times of type Time.
+// Compile with -DWFQ_CALENDAR_QUEUE to use a calendar queue (see calendar_queue.h) instead of a binary heap,
+// or with -DWFQ_DARY_HEAP=<arity> (for example, 4 or 8) to use a d-ary heap (see dary_heap.h).
+#if defined(WFQ_CALENDAR_QUEUE)
+template <class Time>
+using ActiveChannelQueue = CalendarQueue<BasicActiveChannelEntry<Time>>;
+#elif defined(WFQ_DARY_HEAP)
+template <class Time>
+using ActiveChannelQueue = DaryHeap<BasicActiveChannelEntry<Time>, WFQ_DARY_HEAP>;
+#else
+template <class Time>
+using ActiveChannelQueue = std::priority_queue<BasicActiveChannelEntry<Time>>;
+#endif
+
+// An item passed to the thread of a shard (see Shard).
+struct ShardInputItem {
+    enum class Kind : uint8_t {
+        packet,
+        // The end of the input: transmit all the remaining packets.
+        end,
+        // A bad input line: stop right away, as the whole program does when it reads a bad line.
+        stop,
+        // No later packet arrives before packet.packet.time (the only field that is set): the shard answers with
+        // a watermark, so the merge of the outputs can go on while the shard has no packets (see dispatch_to_shards).
+        tick,
+    };
+    Kind kind = Kind::packet;
+    // The packet, with the channel id of the shard.
+    InputPacket packet;
+    // The packet's channel id (see intern_connection).
+    uint32_t channel = 0;
 };
 
-// A map that maps connection strings (source ip, source port, destination ip, destination port) to channels.
-std::unordered_map<std::string, ChannelInfo> channelMap;
-// A small buffer for a packet that has been read from stdin but not yet added to a channel.
-std::optional<PacketInfo> next_packet;
-
-// Get a channel from channelMap, or create it if it doesnt exist yet.
-ChannelInfo &get_or_create_channel(const std::string& connection) {
-    auto iter = channelMap.find(connection);
-    // If the channel already exists, return it.
-    if (iter != channelMap.end()) return iter->second;
-    // If the channel is not in the map, add it.
-    ChannelInfo new_channel{.index = channelMap.size()};
-    auto iter_and_bool = channelMap.insert({ connection, new_channel });
-    return iter_and_bool.first->second;
+// An item of the output of a shard, which the merger thread merges with the outputs of the other shards
+// (see merge_shard_outputs).
+struct ShardOutputItem {
+    enum class Kind : uint8_t {
+        // A transmitted packet (with its channel id, see intern_connection).
+        packet,
+        // The shard will not transmit any more packets before transmit_time (the only field that is set).
+        watermark,
+        // The shard has finished.
+        end,
+    };
+    Kind kind = Kind::packet;
+    uint64_t transmit_time = 0;
+    PacketInfo packet;
+    std::string_view connection;
+};
+
+// The data kept with each packet in the scheduler, for writing it when it is transmitted.
+struct PacketPayload {
+    // The time when the packet arrived.
+    uint64_t time = 0;
+    // The packet's weight, if written explicitly.
+    std::optional<double> weight;
+};
+
+// The data kept with each packet by the unweighted scheduler, whose packets have no weights, so it keeps half as much.
+struct UnweightedPacketPayload {
+    // The time when the packet arrived.
+    uint64_t time = 0;
+};
+
+// Returns the weight kept with a packet, if any.
+std::optional<double> payload_weight(const PacketPayload& payload) {
+    return payload.weight;
 }
 
-// A priority queue that contains active channels, sorted by their priority and index.
-struct ActiveChannelEntry {
-    // The channel.
-    // Note: this pointer points directly into channelMap.
-    // This is OK because unordered_map entries are guaranteed to have a stable address in memory.
-    ChannelInfo *channel;
-    // The channel's priority when it was added to the priority queue.
-    double priority_snapshot;
+std::optional<double> payload_weight(const UnweightedPacketPayload&) {
+    return std::nullopt;
+}
+
+// Like WFQ_PHASE, but only in the main thread, since the phase timer is not thread-safe.
+#define WFQ_SCHEDULER_PHASE(phase) (shard_output == nullptr ? WFQ_PHASE(phase) : (void)0)
+
+// The driver of the WFQ scheduler of a single output link (see wfq_scheduler.h): it reads packets from the input,
+// adds them to the scheduler when they arrive, and writes the packets the scheduler transmits.
+// Normally there is a single scheduler, which gets its packets from next_input_packet, and writes them with
+// write_packet. With --shards, each shard has its own scheduler, which runs in the shard's thread (see Shard).
+//
+// There are two variants, chosen up front (see Options::unweighted): the general one, and one for unweighted traces
+// (Weighted is false), which schedules with integer virtual times (see UnweightedVirtualClock), and doesn't keep or
+// look at weights anywhere between reading a packet and writing it.
+// With --class-prefix (Hierarchical is true), the packets are scheduled by a HierarchicalWfqScheduler instead,
+// and each new channel is put in its class (see intern_class).
+template <bool Weighted, bool Hierarchical = false>
+class Scheduler {
+public:
+    using Clock = std::conditional_t<Weighted, VirtualClock, UnweightedVirtualClock>;
+    using Payload = std::conditional_t<Weighted, PacketPayload, UnweightedPacketPayload>;
+    using Queue = ActiveChannelQueue<typename Clock::Time>;
+
+    using Wfq = std::conditional_t<Hierarchical, HierarchicalWfqScheduler<Payload, Queue, Clock>,
+        WfqScheduler<Payload, Queue, Clock>>;
+
+    // The scheduler of the link.
+    Wfq wfq{ options.limits, options.weight_update };
+    // The connections of the channels, indexed by their ids.
+    // Note: these are views into the channels' keys in channel_ids (or into keyed_connections, with --packed-keys).
+    std::vector<std::string_view> connections;
+    // A small buffer for a packet that has been read from the input but not yet added to a channel.
+    std::optional<InputPacket> next_packet;
+    // The number of packets (and bytes) dropped because of the queue limits.
+    uint64_t dropped_packets = 0;
+    uint64_t dropped_bytes = 0;
+    // The latency statistics (with --latency-stats), by the ids of this scheduler's channels.
+    LatencyStats latency;
+
+    // If not null, this scheduler belongs to a shard: it takes its packets from shard_input (with the channel ids
+    // of the shard), and pushes the transmitted packets to shard_output.
+    SpscRing<ShardInputItem>* shard_input = nullptr;
+    SpscRing<ShardOutputItem>* shard_output = nullptr;
+    // In a shard, the channel id (see intern_connection) of each channel, indexed by its id in the shard.
+    std::vector<uint32_t> shard_channel_ids;
+
+    // Transmits all the packets of the input, starting with the link at the given time (which is not 0 when resuming
+    // from a checkpoint, see restore).
+    void run(uint64_t time = 0) {
+        while (true) {
+            if constexpr (!Hierarchical) {
+                if (!options.checkpoint_path.empty() && packets_read_ >= next_checkpoint_) save_checkpoint(time);
+            }
+            if (wfq.empty()) {
+                // If there are no packets to send, flush the output and read a batch of packets.
+                WFQ_SCHEDULER_PHASE(output);
+                flush();
+                if (shard_output != nullptr) push_watermark();
+                // If no packets were read, exit the loop.
+                if (read_batch() == 0 || stopped_) break;
+                // The link starts again when the packet it sends next arrives (which, with out-of-order input,
+                // is not necessarily the last packet read), but never before the previous packet ended.
+                time = std::max(time, wfq.next_payload()->time);
+            }
+            // Transmit packets until one ends at or after the next arrival (the input is not looked at until then,
+            // since nothing can change the order of the packets before it).
+            time = transmit_until(time, next_arrival_time());
+
+            // Check if, while sending these packets, new packets have arrived.
+            read_with_timeout(time);
+            if (stopped_) break;
+        }
+    }
+
+    // Restores the state of the checkpoint to resume from (see start_resume, which restores the rest first),
+    // and returns the time of the link to run from.
+    uint64_t restore(const CheckpointReader& checkpoint) {
+        const CheckpointHeader& header = checkpoint.header();
+        connections = connection_names;
+        wfq.restore_link(from_checkpoint_bits<typename Clock::Time>(header.virtual_time), header.link_free_time);
+        uint64_t num_packets = 0;
+        for (uint64_t i = 0; i < header.num_channels; i++) {
+            CheckpointChannel saved = checkpoint.channel(i);
+            if (saved.id >= num_connections || saved.num_packets > header.num_packets - num_packets) {
+                input_error("bad checkpoint: bad channel " + std::to_string(saved.id));
+            }
+            wfq.restore_channel({ .id = saved.id, .num_packets = saved.num_packets,
+                .rate = from_checkpoint_bits<typename Wfq::Rate>(saved.rate),
+                .last_finish_time = from_checkpoint_bits<typename Clock::Time>(saved.last_finish_time),
+                .head_start_time = from_checkpoint_bits<typename Clock::Time>(saved.head_start_time) });
+            for (uint32_t j = 0; j < saved.num_packets; j++) {
+                BinaryPacketRecord record = checkpoint.packet(num_packets++);
+                Payload payload;
+                payload.time = record.time;
+                if constexpr (Weighted) payload.weight = record.optional_weight();
+                wfq.restore_packet(saved.id, record.length, std::move(payload));
+            }
+        }
+        for (uint64_t i = 0; i < header.num_evicted_rates; i++) {
+            CheckpointRate saved = checkpoint.evicted_rate(i);
+            wfq.restore_evicted_rate(saved.channel, from_checkpoint_bits<typename Wfq::Rate>(saved.rate));
+        }
+        if ((header.flags & CheckpointHeader::has_next_packet) != 0) {
+            const BinaryPacketRecord& record = header.next_packet;
+            if (record.channel >= num_connections) {
+                input_error("bad checkpoint: bad channel " + std::to_string(record.channel));
+            }
+            next_packet = InputPacket{ .packet = { .time = record.time, .length = record.length,
+                .weight = record.optional_weight(), .channel = record.channel }, .new_connection = {} };
+        }
+        last_arrival_time_ = header.last_arrival_time;
+        dropped_packets = header.dropped_packets;
+        dropped_bytes = header.dropped_bytes;
+        packets_read_ = header.packets_read;
+        next_checkpoint_ = packets_read_ + options.checkpoint_interval;
+        return header.time;
+    }
+
+private:
+    // True if a shard got the end of its input, and if it got a stop item.
+    bool input_ended_ = false;
+    bool stopped_ = false;
+    // In a shard, no packet that hasn't been read yet arrives before arrival_bound_ (see ShardInputItem::Kind::tick),
+    // and no queued packet arrived before first_queued_arrival_, the arrival time of the packet that was added when
+    // there were no packets. The last watermark pushed to shard_output is watermark_.
+    uint64_t arrival_bound_ = 0;
+    uint64_t first_queued_arrival_ = 0;
+    uint64_t watermark_ = 0;
+    // The arrival time of the last packet added to wfq.
+    uint64_t last_arrival_time_ = 0;
+    // The number of packets read from the input, and the number at which the next checkpoint is written
+    // (with --checkpoint).
+    uint64_t packets_read_ = 0;
+    uint64_t next_checkpoint_ = options.checkpoint_interval;
+
+    // Writes a checkpoint of the state to options.checkpoint_path (see checkpoint.h), with the link at the given time.
+    // It is written at the top of the loop of run(), where the whole state is in wfq, next_packet and the members
+    // (besides the time), and only with a single scheduler that reads stdin and writes stdout itself.
+    // The output so far is written first, so the output position of the checkpoint is all written.
+    // If the checkpoint can't be written, it is reported, and the run goes on.
+    void save_checkpoint(uint64_t time) {
+        WFQ_SCHEDULER_PHASE(output);
+        output.finish();
+        Checkpoint checkpoint;
+        CheckpointHeader& header = checkpoint.header;
+        header.flags = checkpoint_flags();
+        header.max_channel_packets = options.limits.max_channel_packets;
+        header.max_packets = options.limits.max_packets;
+        header.input_offset = input.offset();
+        header.output_position = output.position();
+        header.time = time;
+        header.last_arrival_time = last_arrival_time_;
+        header.link_free_time = wfq.link_free_time();
+        header.virtual_time = checkpoint_bits(wfq.virtual_time());
+        header.dropped_packets = dropped_packets;
+        header.dropped_bytes = dropped_bytes;
+        header.packets_read = packets_read_;
+        if (next_packet.has_value()) {
+            const PacketInfo& packet = next_packet->packet;
+            header.flags |= CheckpointHeader::has_next_packet;
+            header.next_packet = BinaryPacketRecord::make(packet.time, packet.channel, packet.length, packet.weight);
+        }
+        wfq.save(
+            [&](const typename Wfq::SavedChannel& channel) {
+                checkpoint.channels.push_back({ channel.id, channel.num_packets, checkpoint_bits(channel.rate),
+                    checkpoint_bits(channel.last_finish_time), checkpoint_bits(channel.head_start_time) });
+            },
+            [&](uint32_t channel, uint64_t length, const Payload& payload) {
+                checkpoint.packets.push_back(BinaryPacketRecord::make(payload.time, channel, length,
+                    payload_weight(payload)));
+            },
+            [&](uint32_t channel, typename Wfq::Rate rate) {
+                checkpoint.evicted_rates.push_back({ channel, 0, checkpoint_bits(rate) });
+            });
+        if (!write_checkpoint(options.checkpoint_path, checkpoint, connection_names)) {
+            std::cerr << "could not write the checkpoint " << options.checkpoint_path << std::endl;
+        }
+        next_checkpoint_ = packets_read_ + options.checkpoint_interval;
+    }
+
+    // Returns the next packet of the input, or std::nullopt at its end.
+    // In a shard, also returns std::nullopt when a tick shows that no packet arrives by max_time.
+    std::optional<InputPacket> next_input(uint64_t max_time) {
+        if (shard_input == nullptr) return next_input_packet();
+        // Nothing is pushed after the end of the input.
+        if (input_ended_ || arrival_bound_ > max_time) return std::nullopt;
+        while (true) {
+            ShardInputItem item = shard_input->pop();
+            if (item.kind == ShardInputItem::Kind::packet) {
+                if (item.packet.packet.channel == shard_channel_ids.size()) shard_channel_ids.push_back(item.channel);
+                return item.packet;
+            }
+            if (item.kind == ShardInputItem::Kind::tick) {
+                arrival_bound_ = std::max(arrival_bound_, item.packet.packet.time);
+                push_watermark();
+                if (arrival_bound_ > max_time) return std::nullopt;
+                continue;
+            }
+            input_ended_ = true;
+            stopped_ = item.kind == ShardInputItem::Kind::stop;
+            return std::nullopt;
+        }
+    }
+
+    // Pushes a watermark to shard_output, if it is later than the last one: nothing is transmitted before the link is
+    // free, or before the earliest arrival time of the packets that are queued or not read yet.
+    void push_watermark() {
+        uint64_t watermark = std::max(wfq.link_free_time(), wfq.empty() ? arrival_bound_ : first_queued_arrival_);
+        if (watermark <= watermark_) return;
+        watermark_ = watermark;
+        shard_output->push({ ShardOutputItem::Kind::watermark, watermark, {}, {} });
+    }
+
+    // Returns the arrival time of the next packet of the input, which has already been read into next_packet
+    // (by read_with_timeout), or the maximum time if there are no more packets.
+    // In a shard whose read was ended by a tick, returns the earliest time the next packet may arrive.
+    uint64_t next_arrival_time() const {
+        if (next_packet.has_value()) return next_packet->packet.time;
+        if (shard_input != nullptr && !input_ended_) return arrival_bound_;
+        return std::numeric_limits<uint64_t>::max();
+    }
+
+    // Transmits packets, starting at time, until the scheduler is empty or a packet ends at or after arrival_time
+    // (so that the packets that arrive by then can be added before the next packet is chosen).
+    // Returns the time when the link becomes free.
+    uint64_t transmit_until(uint64_t time, uint64_t arrival_time) {
+        do {
+            // Transmit the packet of the channel with the highest priority.
+            WFQ_SCHEDULER_PHASE(schedule);
+            size_t num_active_channels = wfq.num_active_channels();
+            auto departure = wfq.dequeue(time);
+            // The link is always free at time, since it is when the previous packet ended (or later).
+            assert(departure.has_value());
+            PacketInfo p{ .time = departure->payload.time, .length = departure->length,
+                .weight = payload_weight(departure->payload), .channel = departure->channel };
+
+            if (options.latency_stats) {
+                latency.channels[p.channel].record(time - p.time);
+                latency.active_channels.record(num_active_channels, p.length);
+            }
 
-    // Compares the priority of two channels.
-    bool operator<(const ActiveChannelEntry& other) const {
-        if (priority_snapshot != other.priority_snapshot)
-            return priority_snapshot > other.priority_snapshot;
-        return channel->index > other.channel->index;
+            WFQ_SCHEDULER_PHASE(output);
+            write(time, p, connections[p.channel]);
+            time += p.length;
+        } while (time < arrival_time && !wfq.empty());
+        WFQ_SCHEDULER_PHASE(schedule);
+        return time;
+    }
+
+    // Writes (or, in a shard, passes to the merger thread) a transmitted packet.
+    void write(uint64_t transmit_time, const PacketInfo& packet, std::string_view connection) {
+        if (shard_output != nullptr) {
+            PacketInfo transmitted = packet;
+            transmitted.channel = shard_channel_ids[packet.channel];
+            shard_output->push({ ShardOutputItem::Kind::packet, transmit_time, transmitted, connection });
+        }
+        else {
+            write_packet(transmit_time, packet, connection);
+        }
+    }
+
+    void flush() {
+        if (shard_output == nullptr) flush_output();
+    }
+
+    // Reads a batch of PacketInfo's from the input.
+    // A batch is defined as a sequence of packets with the same arrival time.
+    // Does not read packets whose arrival time is greater than max_time.
+    // Adds all the PacketInfo's read into the scheduler (and creates new channels if necessary).
+    // Returns the number of PacketInfo's read, which may be 0.
+    size_t read_batch_with_timeout(uint64_t max_time) {
+        size_t num_read;
+        for (num_read = 0;; num_read++) {
+            if (!next_packet.has_value()) {
+                // If no packet has already been read, read a packet from the input.
+                next_packet = next_input(max_time);
+                if (!next_packet.has_value()) break;
+                packets_read_++;
+                if (shard_output == nullptr) WFQ_COUNT_PACKET();
+            }
+            const PacketInfo& packet = next_packet->packet;
+            // If the next packet's time is greater than max_time, stop reading.
+            if (packet.time > max_time) break;
+            // Don't read further packets if their arrival time is greater than the current packet's.
+            max_time = packet.time;
+
+            // Add the new packet to its channel, and keep the connection of a new channel.
+            WFQ_SCHEDULER_PHASE(enqueue);
+            if (packet.channel == connections.size()) {
+                connections.push_back(next_packet->new_connection);
+                if (options.latency_stats) latency.channels.emplace_back();
+                if constexpr (Hierarchical) {
+                    std::optional<double> class_weight;
+                    uint32_t class_id = intern_class(next_packet->new_connection, class_weight);
+                    if (class_weight.has_value()) wfq.add_class(*class_weight);
+                    wfq.add_channel(packet.channel, class_id);
+                }
+            }
+            if (wfq.empty()) first_queued_arrival_ = packet.time;
+            Payload payload;
+            payload.time = packet.time;
+            if constexpr (Weighted) payload.weight = packet.weight;
+            auto drop = wfq.enqueue(packet.channel, packet.length, packet.weight, std::move(payload));
+            if (drop.has_value()) {
+                dropped_packets++;
+                dropped_bytes += drop->length;
+            }
+            last_arrival_time_ = packet.time;
+            next_packet.reset();
+        }
+        return num_read;
+    }
+
+    // Reads a batch of PacketInfo's from the input.
+    // A batch is defined as a sequence of packets with the same arrival time.
+    // Adds all the PacketInfo's read into the scheduler (and creates new channels if necessary).
+    // Returns the number of PacketInfo's read, which may be 0.
+    size_t read_batch() {
+        return read_batch_with_timeout(std::numeric_limits<uint64_t>::max());
+    }
+
+    // Reads a sequence of PacketInfo's from the input.
+    // Does not read packets whose arrival time is greater than max_time.
+    // Adds all the PacketInfo's read into the scheduler (and creates new channels if necessary).
+    // Returns the number of PacketInfo's read, which may be 0.
+    size_t read_with_timeout(uint64_t max_time) {
+        size_t sum = 0;
+        while (true) {
+            size_t count = read_batch_with_timeout(max_time);
+            if (count == 0) break;
+            sum += count;
+        }
+        return sum;
     }
 };
-// Channels that have packets ready to send, ordered by priority.
-std::priority_queue<ActiveChannelEntry> active_channels;
 
-// Add a new channel to active_channels.
-void mark_channel_active(ChannelInfo& channel) {
-    assert(!channel.Q.empty());
-    const PacketInfo& packet = channel.Q.front();
+// A shard of the sharded mode (--shards N): an independent output link with its own scheduler, running in its own
+// thread (pinned to its own core, when possible). The main thread reads the input, and sends each packet to the shard
+// chosen by its connection (see shard_of), with the channel ids of the shard (see shard_channels).
+// Each shard passes the packets it transmits to the merger thread (see merge_shard_outputs), which writes them as a
+// single output, ordered by their transmit times (and by shard, for equal times). Both rings of a shard are bounded,
+// so the memory doesn't grow with the length of the input.
+struct Shard {
+    // The number of items in each ring of each shard.
+    static constexpr size_t ring_size = 1 << 14;
 
-    // Compute start time for this packet
-    double start_time = std::max(virtual_time, channel.last_finish_time);
-    // Compute virtual finish time based on weight
-    double finish_time = start_time + static_cast<double>(packet.length) / channel.weight;
+    // The shard's scheduler: Scheduler<false> if options.unweighted is set.
+    std::variant<Scheduler<true>, Scheduler<false>> scheduler;
+    SpscRing<ShardInputItem> input{ ring_size };
+    SpscRing<ShardOutputItem> output{ ring_size };
+    // The arrival time of the last tick sent to the shard (see dispatch_to_shards).
+    uint64_t tick_time = 0;
+    // The number of channels of the shard (its scheduler keeps their channel ids, see Scheduler::shard_channel_ids).
+    uint32_t num_channels = 0;
+    std::thread thread;
+};
+std::vector<std::unique_ptr<Shard>> shards;
+// The thread that merges the outputs of the shards.
+std::thread shard_merger;
+// For each channel id (see intern_connection), the shard of the channel and its channel id in the shard.
+std::vector<std::pair<uint32_t, uint32_t>> shard_channels;
 
-    // Save for the next packet from this channel
-    channel.last_finish_time = finish_time;
-    channel.is_active = true;
-    // Insert into priority queue with finish time as the priority
-    active_channels.push({ &channel, finish_time });
+// Returns the field of a connection ("sadd sport dadd dport") that chooses its shard (see Options::shard_by).
+std::string_view shard_key(std::string_view connection) {
+    if (options.shard_by == ShardBy::connection) return connection;
+    for (int i = 0; i < static_cast<int>(options.shard_by); i++) {
+        size_t space = connection.find(' ');
+        if (space == std::string_view::npos) return connection;
+        connection.remove_prefix(space + 1);
+    }
+    return connection.substr(0, connection.find(' '));
 }
 
+// Returns the shard of a new connection.
+uint32_t shard_of(std::string_view connection) {
+    return static_cast<uint32_t>(std::hash<std::string_view>{}(shard_key(connection)) % shards.size());
+}
 
-// Reads a batch of PacketInfo's from stdin.
-// A batch is defined as a sequence of packets with the same arrival time.
-// Does not read packets whose arrival time is greater than max_time.
-// Adds all the PacketInfo's read into the appropriate channels (and creates new channels if necessary).
-// Returns the number of PacketInfo's read, which may be 0.
-size_t read_batch_with_timeout(uint64_t max_time) {
-    std::string line;
-    size_t num_read;
-    for (num_read = 0;; num_read++) {
-        if (!next_packet.has_value()) {
-            // If no packet has already been read, read a packet from stdin.
-            if (!std::getline(std::cin, line)) break;
-            next_packet = PacketInfo::parse(line.c_str());
-        }
-		// If the next packet's time is greater than max_time, stop reading.
-        if (next_packet->time > max_time) break;
-        // Don't read further packets if their arrival time is greater than the current packet's.
-        max_time = next_packet->time;
-
-        // Get or create a channel, and add the new packet to it.
-        ChannelInfo &channel = get_or_create_channel(next_packet->connection);
-        channel.Q.push(*next_packet);
-        if (next_packet->weight.has_value()) {
-            // If the packet has an explicit weight, update the channel's weight.
-            channel.weight = *next_packet->weight;
-        }
-        if (channel.Q.size() == 1) {
-			mark_channel_active(channel);
-        }
-        next_packet.reset();
-    }
-    return num_read;
-}
-
-// Reads a batch of PacketInfo's from stdin.
-// A batch is defined as a sequence of packets with the same arrival time.
-// Adds all the PacketInfo's read into the appropriate channels (and creates new channels if necessary).
-// Returns the number of PacketInfo's read, which may be 0.
-size_t read_batch() {
-    return read_batch_with_timeout(std::numeric_limits<uint64_t>::max());
-}
-
-// Reads a sequence of PacketInfo's from stdin.
-// Does not read packets whose arrival time is greater than max_time.
-// Adds all the PacketInfo's read into the appropriate channels (and creates new channels if necessary).
-// Returns the number of PacketInfo's read, which may be 0.
-size_t read_with_timeout(uint64_t max_time) {
-    size_t sum = 0;
+// Pins the current thread to a core, if the platform supports it. This is only a hint, so errors are ignored.
+void pin_to_core(unsigned core) {
+#ifdef __linux__
+    unsigned num_cores = std::thread::hardware_concurrency();
+    if (num_cores == 0) return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % num_cores, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void)core;
+#endif
+}
+
+// Merges the outputs of the shards, and writes them (in the merger thread), until all the shards have finished.
+// The packets are written in the order of their transmit times, and then of their shards. A shard's packets are
+// transmitted in order, so its next packet is never earlier than its last one, or than its last watermark.
+void merge_shard_outputs() {
+    using Kind = ShardOutputItem::Kind;
+    struct Head {
+        // The next item of the shard, if it has been popped.
+        std::optional<ShardOutputItem> item;
+        // The earliest transmit time of the shard's next packet.
+        uint64_t min_time = 0;
+        bool ended = false;
+    };
+    std::vector<Head> heads(shards.size());
     while (true) {
-        size_t count = read_batch_with_timeout(max_time);
-        if (count == 0) break;
-        sum += count;
+        // The first packet among the heads, by transmit time and then by shard.
+        std::optional<size_t> first;
+        for (size_t i = 0; i < heads.size(); i++) {
+            if (heads[i].item.has_value() &&
+                (!first.has_value() || heads[i].item->transmit_time < heads[*first].item->transmit_time)) {
+                first = i;
+            }
+        }
+        // A shard whose next packet may come before it, which has to be popped first.
+        std::optional<size_t> waiting;
+        for (size_t i = 0; i < heads.size() && !waiting.has_value(); i++) {
+            const Head& head = heads[i];
+            if (head.item.has_value() || head.ended) continue;
+            if (!first.has_value() || head.min_time < heads[*first].item->transmit_time ||
+                (head.min_time == heads[*first].item->transmit_time && i < *first)) {
+                waiting = i;
+            }
+        }
+        if (waiting.has_value()) {
+            Head& head = heads[*waiting];
+            ShardOutputItem item = shards[*waiting]->output.pop();
+            if (item.kind == Kind::packet) head.item = item;
+            else if (item.kind == Kind::watermark) head.min_time = std::max(head.min_time, item.transmit_time);
+            else head.ended = true;
+            continue;
+        }
+        if (!first.has_value()) break;
+        Head& head = heads[*first];
+        const ShardOutputItem& item = *head.item;
+        output_packet(item.transmit_time, item.packet, item.connection);
+        // The shard's link is busy until this packet ends.
+        head.min_time = item.transmit_time + item.packet.length;
+        head.item.reset();
     }
-    return sum;
+    // The output is finished by the thread that wrote it, as in the pipelined mode: with io_uring, the writes that
+    // are still in flight when a thread exits are cancelled.
+    flush_stdout(true);
 }
 
-// The main function that processes the input and outputs the results.
-int main() {
+// Starts the threads of the shards.
+void start_shards(unsigned num_shards) {
+    for (unsigned i = 0; i < num_shards; i++) {
+        Shard& shard = *shards.emplace_back(std::make_unique<Shard>());
+        if (options.unweighted) shard.scheduler.emplace<Scheduler<false>>();
+        std::visit([&shard](auto& scheduler) {
+            scheduler.shard_input = &shard.input;
+            scheduler.shard_output = &shard.output;
+        }, shard.scheduler);
+        shard.thread = std::thread([&shard, i] {
+            pin_to_core(i);
+            std::visit([](auto& scheduler) { scheduler.run(); }, shard.scheduler);
+            shard.output.push({ ShardOutputItem::Kind::end, 0, {}, {} });
+        });
+    }
+    shard_merger = std::thread(merge_shard_outputs);
+}
+
+// Sends all the packets of the input to their shards.
+//
+// The merger can only write a packet when it knows that no other shard will transmit a packet before it, which a shard
+// that has no packets can't tell by itself. So when the ring of a shard is full (and the dispatcher is about to wait
+// for it, which may be because its output is waiting for the merger), every other shard that has room gets a tick
+// with the arrival time of the current packet, and answers with a watermark (see Scheduler::next_input).
+// The arrival times must not decrease for the ticks to be right: with out-of-order input, a packet that arrives
+// earlier than a tick its shard already got is scheduled as if it arrived at the tick, and may be written after
+// packets of other shards that are transmitted later.
+void dispatch_to_shards() {
+    while (std::optional<InputPacket> packet = next_input_packet()) {
+        WFQ_COUNT_PACKET();
+        uint32_t channel = packet->packet.channel;
+        if (channel == shard_channels.size()) {
+            uint32_t shard = shard_of(packet->new_connection);
+            shard_channels.emplace_back(shard, shards[shard]->num_channels++);
+        }
+        auto [shard, shard_channel] = shard_channels[channel];
+        packet->packet.channel = shard_channel;
+        ShardInputItem item{ ShardInputItem::Kind::packet, *packet, channel };
+        if (shards[shard]->input.try_push(item)) continue;
+        uint64_t time = packet->packet.time;
+        for (auto& other : shards) {
+            if (other->tick_time >= time) continue;
+            ShardInputItem tick{ ShardInputItem::Kind::tick, {}, 0 };
+            tick.packet.packet.time = time;
+            // A shard whose ring is full has packets to transmit, so it doesn't need a tick.
+            if (other->input.try_push(tick)) other->tick_time = time;
+        }
+        shards[shard]->input.push(item);
+    }
+}
+
+// Waits for all the shards to finish, and for their merged output to be written.
+// If stop is true, the shards stop right away, instead of transmitting their remaining packets.
+void finish_shards(bool stop) {
+    for (auto& shard : shards) {
+        shard->input.push({ stop ? ShardInputItem::Kind::stop : ShardInputItem::Kind::end, {}, 0 });
+    }
+    WFQ_PHASE(output);
+    if (shard_merger.joinable()) shard_merger.join();
+    for (auto& shard : shards) {
+        shard->thread.join();
+        std::visit([](const auto& scheduler) {
+            dropped_packets += scheduler.dropped_packets;
+            dropped_bytes += scheduler.dropped_bytes;
+            if (options.latency_stats) {
+                const LatencyStats& latency = scheduler.latency;
+                latency_stats.channels.resize(num_connections);
+                for (size_t i = 0; i < latency.channels.size(); i++) {
+                    latency_stats.channels[scheduler.shard_channel_ids[i]].add(latency.channels[i]);
+                }
+                latency_stats.active_channels.add(latency.active_channels);
+            }
+        }, shard->scheduler);
+    }
+    shards.clear();
+    flush_stdout(true);
+}
+
+[[noreturn]] void usage(const char* program) {
+    std::cerr << "usage: " << program << " [--packed-keys] [--pipelined | [--parse-threads N]"
+        " [--shards N [--shard-by src-addr|src-port|dst-addr|dst-port|connection]]]"
+        " [--input-format text|binary] [--output-format text|binary]"
+        " [--streaming] [--max-queue N] [--max-packets N] [--drop-policy tail|longest] [--immediate-weights]"
+        " [--latency-stats] [--unweighted] [--io-uring]"
+        " [--checkpoint FILE [--checkpoint-interval N]] [--resume FILE]"
+        " [--class-prefix 1|2|3 [--class-weights FILE]] < input" << std::endl;
+    std::exit(1);
+}
+
+// Parses the command line options. Exits with an error message if an option is not recognized.
+Options parse_options(int argc, char* argv[]) {
+    Options result;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--packed-keys") {
+            result.packed_keys = true;
+        }
+        else if (arg == "--pipelined") {
+            result.pipelined = true;
+        }
+        else if (arg == "--parse-threads" && i + 1 < argc) {
+            result.parse_threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if ((arg == "--input-format" || arg == "--output-format") && i + 1 < argc) {
+            std::string_view format = argv[++i];
+            if (format != "text" && format != "binary") {
+                std::cerr << "unknown format: " << format << std::endl;
+                usage(argv[0]);
+            }
+            (arg == "--input-format" ? result.binary_input : result.binary_output) = format == "binary";
+        }
+        else if (arg == "--max-queue" && i + 1 < argc) {
+            result.limits.max_channel_packets = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--max-packets" && i + 1 < argc) {
+            result.limits.max_packets = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--drop-policy" && i + 1 < argc) {
+            std::string_view policy = argv[++i];
+            if (policy == "tail") result.limits.drop_policy = DropPolicy::tail;
+            else if (policy == "longest") result.limits.drop_policy = DropPolicy::longest;
+            else {
+                std::cerr << "unknown drop policy: " << policy << std::endl;
+                usage(argv[0]);
+            }
+        }
+        else if (arg == "--immediate-weights") {
+            result.weight_update = WeightUpdate::immediate;
+        }
+        else if (arg == "--latency-stats") {
+            result.latency_stats = true;
+        }
+        else if (arg == "--unweighted") {
+            result.unweighted = true;
+        }
+        else if (arg == "--io-uring") {
+            result.io_uring = true;
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc) {
+            result.checkpoint_path = argv[++i];
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            result.checkpoint_interval = std::max<uint64_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--resume" && i + 1 < argc) {
+            result.resume_path = argv[++i];
+        }
+        else if (arg == "--class-prefix" && i + 1 < argc) {
+            result.class_prefix = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+            if (result.class_prefix < 1 || result.class_prefix > 3) {
+                std::cerr << "the class prefix must be 1, 2 or 3 fields" << std::endl;
+                usage(argv[0]);
+            }
+        }
+        else if (arg == "--class-weights" && i + 1 < argc) {
+            result.class_weights_path = argv[++i];
+        }
+        else if (arg == "--streaming") {
+            result.limits.evict_idle_channels = true;
+        }
+        else if (arg == "--shards" && i + 1 < argc) {
+            result.shards = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--shard-by" && i + 1 < argc) {
+            std::string_view field = argv[++i];
+            if (field == "src-addr") result.shard_by = ShardBy::src_addr;
+            else if (field == "src-port") result.shard_by = ShardBy::src_port;
+            else if (field == "dst-addr") result.shard_by = ShardBy::dst_addr;
+            else if (field == "dst-port") result.shard_by = ShardBy::dst_port;
+            else if (field == "connection") result.shard_by = ShardBy::connection;
+            else {
+                std::cerr << "unknown shard field: " << field << std::endl;
+                usage(argv[0]);
+            }
+        }
+        else {
+            std::cerr << "unknown option: " << arg << std::endl;
+            usage(argv[0]);
+        }
+    }
+    if (result.binary_input && result.parse_threads != 0) {
+        std::cerr << "--parse-threads can only be used with text input" << std::endl;
+        usage(argv[0]);
+    }
+    if (result.pipelined && (result.parse_threads != 0 || result.shards != 0)) {
+        std::cerr << "--pipelined can't be used with --parse-threads or --shards" << std::endl;
+        usage(argv[0]);
+    }
+    if ((!result.checkpoint_path.empty() || !result.resume_path.empty()) && (result.pipelined ||
+        result.parse_threads != 0 || result.shards != 0 || result.latency_stats || result.binary_output)) {
+        std::cerr << "--checkpoint and --resume can't be used with --pipelined, --parse-threads, --shards,"
+            " --latency-stats or --output-format binary" << std::endl;
+        usage(argv[0]);
+    }
+    if (!result.class_weights_path.empty() && result.class_prefix == 0) {
+        std::cerr << "--class-weights can only be used with --class-prefix" << std::endl;
+        usage(argv[0]);
+    }
+    if (result.class_prefix != 0 && (result.shards != 0 || result.limits.max_packets != 0 ||
+        !result.checkpoint_path.empty() || !result.resume_path.empty())) {
+        std::cerr << "--class-prefix can't be used with --shards, --max-packets, --checkpoint or --resume" << std::endl;
+        usage(argv[0]);
+    }
+    return result;
+}
+
+// Transmits all the packets of the input with a single scheduler, and writes the output.
+template <bool Weighted, bool Hierarchical>
+void run_scheduler() {
+    Scheduler<Weighted, Hierarchical> scheduler;
     uint64_t time = 0;
-    while (true) {
-        if (active_channels.empty()) {
-			// If there are no active channels, read a batch of packets.
-			if (read_batch() == 0) break; // If no packets were read, exit the loop.
-            time = active_channels.top().channel->Q.front().time;
-        }
-        // Process the channel with the highest priority.
-        virtual_time = std::max(virtual_time, active_channels.top().priority_snapshot);
-        auto* channel = active_channels.top().channel;
-        active_channels.pop();
-        channel->is_active = false;
-        auto& ch = *channel;
-        PacketInfo p = ch.Q.front();
-        ch.Q.pop();
-
-        std::cout << time << ": " << p << std::endl;
-        time += p.length;
-
-        if (!ch.Q.empty()) {
-            mark_channel_active(ch);
-        }
-        
-        // Check if, while sending this packet, new packets have arrived.
-        read_with_timeout(time);
+    if constexpr (!Hierarchical) {
+        if (!options.resume_path.empty()) time = scheduler.restore(resume_checkpoint);
+    }
+    scheduler.run(time);
+    finish_output();
+    dropped_packets += scheduler.dropped_packets;
+    dropped_bytes += scheduler.dropped_bytes;
+    latency_stats = std::move(scheduler.latency);
+}
+
+// The main function that processes the input and outputs the results.
+int main(int argc, char* argv[]) {
+    options = parse_options(argc, argv);
+    if (!options.class_weights_path.empty()) read_class_weights(options.class_weights_path);
+    if (options.io_uring) {
+        // Where io_uring is not available, the input and the output just use the normal system calls.
+        input.enable_io_uring();
+        output.enable_io_uring();
+    }
+    if (options.binary_input) {
+        set_binary_mode(stdin);
+        start_binary_input();
+    }
+    if (options.binary_output) {
+        set_binary_mode(stdout);
+        binary_output.start();
+    }
+    if (!options.resume_path.empty()) start_resume();
+    if (options.pipelined) pipeline.start();
+    if (options.parse_threads != 0) parse_input_in_parallel(options.parse_threads);
+    if (options.shards != 0) {
+        start_shards(options.shards);
+        dispatch_to_shards();
+        finish_shards(false);
+        report_drops();
+        report_latency();
+        return 0;
+    }
+    if (options.class_prefix != 0) {
+        // The weights of the classes need the weighted scheduler, even if the packets have no weights.
+        if (!class_weights.empty()) options.unweighted = false;
+        if (options.unweighted) run_scheduler<false, true>();
+        else run_scheduler<true, true>();
     }
+    else if (options.unweighted) run_scheduler<false, false>();
+    else run_scheduler<true, false>();
+    report_drops();
+    report_latency();
 }
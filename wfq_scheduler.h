@@ -0,0 +1,707 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dary_heap.h"
+#include "packet_pool.h"
+#include "phase_timer.h"
+
+// A WFQ scheduler for a single output link, which can be used without going through text input and output:
+// packets are added with enqueue(), and taken in transmission order with dequeue().
+// wfq.cpp is a driver around it, which reads the packets from stdin and writes the transmitted packets to stdout.
+//
+// Each packet belongs to a channel (a flow), identified by a small integer id: when two channels have the same
+// finish time, the one with the smaller id is transmitted first, so ids should be given in the order channels appear.
+// A channel is created the first time a packet is added to it.
+//
+// The scheduler also keeps track of the link: a packet of length L that starts its transmission at time T keeps
+// the link busy until T + L, and dequeue() only starts a transmission when the link is free.
+//
+// For streaming operation on unbounded input, the memory can be bounded with WfqLimits: queue limits (with a drop
+// policy), and eviction of idle channels.
+//
+// The whole state can be saved, and restored into a new scheduler (see save), for checkpoints of long runs.
+
+// How virtual times are represented and computed (the VirtualClock parameter of WfqScheduler).
+// A clock has a Time type for virtual times, a Rate type for what each channel keeps to compute the virtual duration of
+// its packets, rate(weight) which converts a weight to a Rate (once, when the weight is set), and
+// duration(length, rate) which is the virtual duration of a packet (length / weight).
+// weighted is false for a clock that ignores weights: enqueue() then never looks at them.
+
+// The default clock: virtual times are doubles, and each packet's duration is a division by the channel's weight.
+struct DoubleVirtualClock {
+    using Time = double;
+    using Rate = double;
+    static constexpr bool weighted = true;
+
+    static Rate rate(double weight) {
+        return weight;
+    }
+
+    static Time duration(uint64_t length, Rate rate) {
+        return static_cast<double>(length) / rate;
+    }
+};
+
+// A fixed-point clock: virtual times are uint64_t's with fraction_bits bits after the binary point, and each channel
+// keeps the reciprocal of its weight in the same format, so each packet's duration is an integer multiplication.
+// Comparing virtual times is an integer comparison, and the schedule is exactly reproducible on any platform and
+// compiler (the only floating-point operation is the correctly-rounded division in rate()).
+// Since reciprocals are rounded to 2^-fraction_bits, finish times that are very close may be ordered differently than
+// with DoubleVirtualClock (exact ties, such as equal weights, stay ties).
+// Virtual times must stay below 2^(64 - fraction_bits) (about 1.7e13 bytes per unit of weight), and weights
+// are clamped to [2^-fraction_bits, 2^fraction_bits].
+struct FixedPointVirtualClock {
+    static constexpr int fraction_bits = 20;
+    using Time = uint64_t;
+    using Rate = uint64_t;
+    static constexpr bool weighted = true;
+
+    static Rate rate(double weight) {
+        constexpr double one = static_cast<double>(uint64_t(1) << fraction_bits);
+        constexpr double max_rate = one * one;
+        double reciprocal = std::round(one / weight);
+        // This is also false for weights that are 0, negative, or NaN.
+        if (!(reciprocal <= max_rate)) return static_cast<Rate>(max_rate);
+        return std::max<Rate>(1, static_cast<Rate>(reciprocal));
+    }
+
+    static Time duration(uint64_t length, Rate rate) {
+        return length * rate;
+    }
+};
+
+// A clock for unweighted traces (pure fair queueing): every channel has weight 1, so virtual times are integers
+// (the sums of packet lengths), which are exactly the same as with DoubleVirtualClock as long as they are below 2^53,
+// and the weights given to enqueue() are ignored.
+struct UnweightedVirtualClock {
+    using Time = uint64_t;
+    using Rate = uint64_t;
+    static constexpr bool weighted = false;
+
+    static Rate rate(double) {
+        return 1;
+    }
+
+    static Time duration(uint64_t length, Rate) {
+        return length;
+    }
+};
+
+// An entry of the priority queue of active channels, for virtual times of type Time.
+template <class Time>
+struct BasicActiveChannelEntry {
+    // The channel's id, which breaks ties between equal priorities.
+    uint32_t channel;
+    // The generation of the entry: the entry is stale if the channel has a newer one (see WeightUpdate::immediate).
+    uint32_t generation;
+    // The channel's priority (virtual finish time) when it was added to the priority queue.
+    Time priority_snapshot;
+
+    // Compares the priority of two channels.
+    bool operator<(const BasicActiveChannelEntry& other) const {
+        if (priority_snapshot != other.priority_snapshot)
+            return priority_snapshot > other.priority_snapshot;
+        return channel > other.channel;
+    }
+};
+using ActiveChannelEntry = BasicActiveChannelEntry<DoubleVirtualClock::Time>;
+// Entries are small and self-contained: comparing two entries never has to look at the channels themselves.
+static_assert(sizeof(ActiveChannelEntry) == 16);
+static_assert(sizeof(BasicActiveChannelEntry<FixedPointVirtualClock::Time>) == 16);
+
+// Adds entries to a priority queue of active channels all at once, with the queue's push_range if it has one
+// (see DaryHeap and CalendarQueue), and otherwise one at a time.
+template <class Queue, class Entry>
+void push_entries(Queue& queue, const std::vector<Entry>& entries) {
+    if constexpr (requires { queue.push_range(entries.begin(), entries.end()); }) {
+        queue.push_range(entries.begin(), entries.end());
+    }
+    else {
+        for (const Entry& entry : entries) queue.push(entry);
+    }
+}
+
+// A std::priority_queue is rebuilt with std::make_heap when that is cheaper (see rebuild_heap_is_cheaper).
+template <class Entry, class Container, class Compare>
+void push_entries(std::priority_queue<Entry, Container, Compare>& queue, const std::vector<Entry>& entries) {
+    using PriorityQueue = std::priority_queue<Entry, Container, Compare>;
+    if (!rebuild_heap_is_cheaper(queue.size(), entries.size())) {
+        for (const Entry& entry : entries) queue.push(entry);
+        return;
+    }
+    // The heap of a std::priority_queue is its protected members c and comp.
+    struct Access : PriorityQueue {
+        static void append(PriorityQueue& queue, const std::vector<Entry>& entries) {
+            Container& heap = queue.*(&Access::c);
+            heap.insert(heap.end(), entries.begin(), entries.end());
+            std::make_heap(heap.begin(), heap.end(), queue.*(&Access::comp));
+        }
+    };
+    Access::append(queue, entries);
+}
+
+// What to drop when a queue limit is reached (see WfqLimits).
+enum class DropPolicy {
+    // Drop the arriving packet.
+    tail,
+    // When the global limit is reached, drop the last packet of the longest queue instead
+    // (or the arriving packet, if its own queue would be the longest). Among queues of the same length,
+    // the one that reached that length most recently is chosen.
+    longest,
+};
+
+// When a new weight of a channel takes effect.
+enum class WeightUpdate {
+    // From the channel's next packet: the finish time of the packet at the head of the queue, which was computed when
+    // it got to the head, is kept.
+    next_packet,
+    // Right away: the finish time of the packet at the head of the queue is computed again with the new weight
+    // (from the same virtual start time). The channel gets a new entry in the priority queue, with a new generation,
+    // and its old entry becomes stale: stale entries are skipped when they get to the top, and the priority queue is
+    // rebuilt without them once there are more stale entries than active channels (plus compaction_slack),
+    // so a weight update is O(log n) and the memory stays bounded.
+    immediate,
+};
+
+// Limits on the memory used by a WfqScheduler. By default, there are no limits.
+struct WfqLimits {
+    // The maximum number of packets in a channel's queue, or 0 for no limit.
+    // A packet that arrives when its channel's queue is full is dropped.
+    size_t max_channel_packets = 0;
+    // The maximum number of packets in all the queues together, or 0 for no limit.
+    size_t max_packets = 0;
+    // What to drop when max_packets is reached.
+    DropPolicy drop_policy = DropPolicy::tail;
+    // Free the state of a channel as soon as its queue becomes empty. At that point its last finish time is at most
+    // the virtual time, so when it gets a new packet it behaves exactly like a new channel with the same id and
+    // weight: only its weight (if it is not 1) is kept. This bounds the memory by the number of non-empty queues
+    // (plus a channel id table of 4 bytes per id), instead of the number of channels ever seen.
+    bool evict_idle_channels = false;
+};
+
+// Payload is any movable data that is kept with each packet, and returned when it is dequeued (or dropped).
+// It is moved in and out of the scheduler, and never copied, so it can also be a move-only type.
+// Queue is the priority queue of active channels: std::priority_queue<BasicActiveChannelEntry<VirtualClock::Time>>,
+// or anything with the same interface and order (such as CalendarQueue or DaryHeap).
+// VirtualClock is DoubleVirtualClock, FixedPointVirtualClock or UnweightedVirtualClock.
+template <class Payload, class Queue = std::priority_queue<ActiveChannelEntry>, class VirtualClock = DoubleVirtualClock>
+class WfqScheduler {
+public:
+    using Time = typename VirtualClock::Time;
+    using Rate = typename VirtualClock::Rate;
+    using ActiveEntry = BasicActiveChannelEntry<Time>;
+
+    // A packet that was dequeued.
+    struct Departure {
+        // The packet's channel.
+        uint32_t channel;
+        // The packet's length.
+        uint64_t length;
+        // The time when the packet's transmission starts.
+        uint64_t start_time;
+        Payload payload;
+    };
+
+    // A packet that was dropped because of a queue limit.
+    struct Drop {
+        // The packet's channel.
+        uint32_t channel;
+        // The packet's length.
+        uint64_t length;
+        Payload payload;
+    };
+
+    // The number of stale entries in the priority queue, beyond the number of active channels, that triggers
+    // its compaction (see WeightUpdate::immediate).
+    static constexpr size_t compaction_slack = 1024;
+
+    // initial_capacity is the number of queued packets there is room for before the packet pool grows.
+    explicit WfqScheduler(const WfqLimits& limits = {}, WeightUpdate weight_update = WeightUpdate::next_packet,
+        size_t initial_capacity = 1 << 16)
+        : limits_(limits), weight_update_(weight_update), packet_pool_(initial_capacity) {}
+
+    // Adds a packet to the end of its channel's queue.
+    // If the packet has an explicit weight, it becomes the channel's weight (the default weight is 1),
+    // either from the next packet of the channel or right away (see WeightUpdate). With an unweighted clock
+    // (see UnweightedVirtualClock), the weight is ignored.
+    // If a queue limit is reached, a packet is dropped (see WfqLimits), and returned: either this packet, which then
+    // does not change its channel at all, or the last packet of another queue.
+    std::optional<Drop> enqueue(uint32_t channel_id, uint64_t length, std::optional<double> weight,
+        Payload payload = {}) {
+        std::optional<Drop> drop;
+        size_t queue_size = channel_id < slots_.size() && slots_[channel_id] != no_slot
+            ? channels_[slots_[channel_id]].Q.size : 0;
+        if (limits_.max_channel_packets != 0 && queue_size >= limits_.max_channel_packets) {
+            return Drop{ channel_id, length, std::move(payload) };
+        }
+        if (limits_.max_packets != 0 && num_packets_ >= limits_.max_packets) {
+            // The longest queue is only shortened if it has more than one packet, since its first packet is already
+            // in active_channels_.
+            uint32_t longest = longest_queue();
+            if (limits_.drop_policy == DropPolicy::tail || longest == no_slot ||
+                channels_[longest].Q.size <= queue_size + 1) {
+                return Drop{ channel_id, length, std::move(payload) };
+            }
+            drop = drop_last_packet(longest);
+        }
+
+        uint32_t slot = get_or_create_slot(channel_id);
+        ChannelInfo& channel = channels_[slot];
+        packet_pool_.push(channel.Q, QueuedPacket{ length, std::move(payload) });
+        num_packets_++;
+        queue_grew(slot);
+        WFQ_COUNT_PEAK(queue_depth, channel.Q.size);
+        if constexpr (!VirtualClock::weighted) {
+            (void)weight;
+        }
+        else if (weight.has_value()) {
+            // If the packet has an explicit weight, update the channel's weight.
+            Rate rate = VirtualClock::rate(*weight);
+            if (rate != channel.rate) {
+                WFQ_COUNT(weight_changes);
+                channel.rate = rate;
+                // The packet at the head of the queue is already in active_channels_ if it isn't this packet.
+                if (weight_update_ == WeightUpdate::immediate && channel.Q.size > 1) {
+                    update_head_finish_time(slot, channel_id);
+                }
+            }
+        }
+        if (channel.Q.size == 1) {
+            // Channels that become active are added to active_channels_ together, when it is used next
+            // (see add_new_entries), since a burst of packets at the same time may activate many channels at once.
+            new_entries_.push_back(activate(slot, channel_id));
+        }
+        return drop;
+    }
+
+    // Starts transmitting the next packet at time now, and returns it.
+    // Returns std::nullopt if there are no packets, or if the link is still busy at time now.
+    std::optional<Departure> dequeue(uint64_t now) {
+        if (num_packets_ == 0 || now < link_free_time_) return std::nullopt;
+        if (!new_entries_.empty()) add_new_entries();
+        if (stale_entries_ != 0) skip_stale_entries();
+        // Process the channel with the highest priority.
+        virtual_time_ = std::max(virtual_time_, active_channels_.top().priority_snapshot);
+        uint32_t channel_id = active_channels_.top().channel;
+        uint32_t slot = slots_[channel_id];
+        active_channels_.pop();
+        WFQ_COUNT(heap_pops);
+        ChannelInfo& channel = channels_[slot];
+        channel.generation = inactive;
+        QueuedPacket packet = std::move(packet_pool_.front(channel.Q));
+        queue_shrinking(slot);
+        packet_pool_.pop(channel.Q);
+        num_packets_--;
+        link_free_time_ = now + packet.length;
+
+        if (!channel.Q.empty()) {
+            active_channels_.push(activate(slot, channel_id));
+            WFQ_COUNT(heap_pushes);
+        }
+        else if (limits_.evict_idle_channels) {
+            // The virtual time is now at least the finish time of the channel's last packet.
+            assert(channel.last_finish_time <= virtual_time_);
+            evict(slot, channel_id);
+        }
+        return Departure{ channel_id, packet.length, now, std::move(packet.payload) };
+    }
+
+    // Returns the length of the packet that dequeue() would transmit next, or std::nullopt if there are no packets.
+    std::optional<uint64_t> next_length() {
+        if (num_packets_ == 0) return std::nullopt;
+        return next_packet().length;
+    }
+
+    // Returns the payload of the packet that dequeue() would transmit next, or nullptr if there are no packets.
+    // The pointer is valid until the scheduler is changed.
+    const Payload* next_payload() {
+        if (num_packets_ == 0) return nullptr;
+        return &next_packet().payload;
+    }
+
+    // Returns the earliest time at which dequeue() will return a packet (which may be in the past),
+    // or std::nullopt if there are no packets.
+    std::optional<uint64_t> next_departure_time() const {
+        if (num_packets_ == 0) return std::nullopt;
+        return link_free_time_;
+    }
+
+    // Returns true if there are no packets waiting to be transmitted.
+    bool empty() const {
+        return num_packets_ == 0;
+    }
+
+    // Returns the number of packets waiting to be transmitted.
+    size_t size() const {
+        return num_packets_;
+    }
+
+    // Returns the number of active channels (channels with packets waiting to be transmitted).
+    size_t num_active_channels() const {
+        return active_channels_.size() + new_entries_.size() - stale_entries_;
+    }
+
+    // Returns the number of channels whose state is in memory (all the channels seen, unless idle channels are evicted).
+    size_t num_channels() const {
+        return channels_.size() - free_slots_.size();
+    }
+
+    // Returns the virtual time, which is used to calculate the priority of channels.
+    Time virtual_time() const {
+        return virtual_time_;
+    }
+
+    // Returns the time when the link finishes transmitting its current packet.
+    uint64_t link_free_time() const {
+        return link_free_time_;
+    }
+
+    // The state of a channel in memory, as saved by save() and restored by restore_channel().
+    struct SavedChannel {
+        uint32_t id = 0;
+        // The number of packets in the channel's queue.
+        uint32_t num_packets = 0;
+        Rate rate = VirtualClock::rate(1.0);
+        Time last_finish_time = 0;
+        // The virtual start time of the packet at the head of the queue (only with WeightUpdate::immediate).
+        Time head_start_time = 0;
+    };
+
+    // Saves the state of the scheduler (besides virtual_time() and link_free_time()), so it can be restored later:
+    // calls on_channel(const SavedChannel&) for each channel in memory, on_packet(channel_id, length, const Payload&)
+    // for each packet in the channel's queue, from the first, before the next channel, and then
+    // on_evicted_rate(channel_id, rate) for each evicted channel whose weight is not 1.
+    // With DropPolicy::longest, the channels come in an order that restores the lists of channels by queue size
+    // exactly, so the same queues are shortened after restoring.
+    template <class OnChannel, class OnPacket, class OnEvictedRate>
+    void save(OnChannel&& on_channel, OnPacket&& on_packet, OnEvictedRate&& on_evicted_rate) const {
+        auto save_channel = [&](uint32_t slot) {
+            const ChannelInfo& channel = channels_[slot];
+            const ChannelDetails& details = details_[slot];
+            on_channel(SavedChannel{ details.id, channel.Q.size, channel.rate, channel.last_finish_time,
+                details.head_start_time });
+            packet_pool_.for_each(channel.Q, [&](const QueuedPacket& packet) {
+                on_packet(details.id, packet.length, packet.payload);
+            });
+        };
+        for (uint32_t slot = 0; slot < channels_.size(); slot++) {
+            bool in_memory = slots_[details_[slot].id] == slot;
+            // With the lists by size, the channels that have packets are saved below.
+            if (in_memory && (!tracks_queue_sizes() || channels_[slot].Q.empty())) save_channel(slot);
+        }
+        if (tracks_queue_sizes()) {
+            // Restoring a channel moves it to the head of its list, so each list is saved from its tail.
+            for (uint32_t head : queues_by_size_) {
+                if (head == no_slot) continue;
+                uint32_t slot = head;
+                while (details_[slot].next_by_size != no_slot) slot = details_[slot].next_by_size;
+                for (; slot != no_slot; slot = details_[slot].prev_by_size) save_channel(slot);
+            }
+        }
+        for (const auto& [channel_id, rate] : evicted_rates_) on_evicted_rate(channel_id, rate);
+    }
+
+    // Restores the virtual time and the link of a saved scheduler, into a new scheduler (with the same limits,
+    // weight update and clock). The channels are then restored with restore_channel(), restore_packet()
+    // and restore_evicted_rate(), in the order in which save() gave them.
+    void restore_link(Time virtual_time, uint64_t link_free_time) {
+        virtual_time_ = virtual_time;
+        link_free_time_ = link_free_time;
+    }
+
+    // Restores a channel that was in memory. Its packets are then restored with restore_packet().
+    void restore_channel(const SavedChannel& saved) {
+        uint32_t slot = get_or_create_slot(saved.id);
+        ChannelInfo& channel = channels_[slot];
+        channel.rate = saved.rate;
+        channel.last_finish_time = saved.last_finish_time;
+        details_[slot].head_start_time = saved.head_start_time;
+    }
+
+    // Restores a packet at the end of a restored channel's queue. With its first packet, the channel gets its entry in
+    // the priority queue back, with its saved last_finish_time (which is the finish time of the packet at the head of
+    // an active channel), so no finish time is computed again. Stale entries are not restored.
+    void restore_packet(uint32_t channel_id, uint64_t length, Payload payload) {
+        uint32_t slot = slots_[channel_id];
+        ChannelInfo& channel = channels_[slot];
+        packet_pool_.push(channel.Q, QueuedPacket{ length, std::move(payload) });
+        num_packets_++;
+        queue_grew(slot);
+        if (channel.Q.size == 1) {
+            channel.generation = next_generation();
+            active_channels_.push({ channel_id, channel.generation, channel.last_finish_time });
+        }
+    }
+
+    // Restores the weight of an evicted channel.
+    void restore_evicted_rate(uint32_t channel_id, Rate rate) {
+        evicted_rates_[channel_id] = rate;
+    }
+
+private:
+    // The slot of a channel that has no state in memory.
+    static constexpr uint32_t no_slot = UINT32_MAX;
+
+    // A packet waiting in its channel's queue.
+    struct QueuedPacket {
+        uint64_t length = 0;
+        Payload payload;
+    };
+
+    // The generation of a channel that has no entry in active_channels_.
+    static constexpr uint32_t inactive = 0;
+
+    // The state of a channel that is used for every packet: its weight, and a queue of packets that are waiting to be
+    // transmitted on this channel. It is 32 bytes, aligned to 32 bytes, so it always fits in one cache line,
+    // and the states of two channels share a line. Everything else about the channel is in ChannelDetails.
+    struct alignas(32) ChannelInfo {
+        // The channel's weight, as a rate of the virtual clock.
+        Rate rate = VirtualClock::rate(1.0);
+        // Last finish time of the channel.
+        Time last_finish_time = 0;
+        // A queue of packets that are waiting to be transmitted on this channel (stored in packet_pool_).
+        PacketQueue Q = {};
+        // The generation of the channel's entry in active_channels_, or inactive if the channel has no entry
+        // (that is, if it has no packets, or while its first packet is being taken out of its queue).
+        uint32_t generation = inactive;
+    };
+    static_assert(sizeof(ChannelInfo) == 32);
+
+    // The state of a channel that is only used on less common paths, kept apart from ChannelInfo
+    // so it doesn't take space in the cache lines of the common path.
+    struct ChannelDetails {
+        // The channel's id.
+        uint32_t id = 0;
+        // The neighbors of the channel in its list in queues_by_size_ (only with DropPolicy::longest).
+        uint32_t prev_by_size = no_slot;
+        uint32_t next_by_size = no_slot;
+        // The virtual start time of the packet at the head of the queue (only with WeightUpdate::immediate).
+        Time head_start_time = 0;
+    };
+
+    // Returns the slot of a channel, and creates its state if it isn't in memory.
+    uint32_t get_or_create_slot(uint32_t channel_id) {
+        if (channel_id >= slots_.size()) slots_.resize(channel_id + 1, no_slot);
+        if (slots_[channel_id] != no_slot) return slots_[channel_id];
+        uint32_t slot;
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+            channels_[slot] = ChannelInfo{};
+            details_[slot] = ChannelDetails{};
+        }
+        else {
+            slot = static_cast<uint32_t>(channels_.size());
+            channels_.emplace_back();
+            details_.emplace_back();
+        }
+        details_[slot].id = channel_id;
+        WFQ_COUNT(new_channels);
+        auto rate = evicted_rates_.find(channel_id);
+        if (rate != evicted_rates_.end()) {
+            channels_[slot].rate = rate->second;
+            evicted_rates_.erase(rate);
+        }
+        slots_[channel_id] = slot;
+        return slot;
+    }
+
+    // Frees the state of an idle channel, keeping only its weight.
+    void evict(uint32_t slot, uint32_t channel_id) {
+        ChannelInfo& channel = channels_[slot];
+        if (channel.rate != VirtualClock::rate(1.0)) evicted_rates_[channel_id] = channel.rate;
+        slots_[channel_id] = no_slot;
+        free_slots_.push_back(slot);
+    }
+
+    // Computes the finish time of the packet at the head of a channel's queue, which just got to the head,
+    // and returns the channel's new entry for active_channels_.
+    ActiveEntry activate(uint32_t slot, uint32_t channel_id) {
+        ChannelInfo& channel = channels_[slot];
+        assert(!channel.Q.empty());
+        const QueuedPacket& packet = packet_pool_.front(channel.Q);
+
+        // Compute start time for this packet
+        Time start_time = std::max(virtual_time_, channel.last_finish_time);
+        // Compute virtual finish time based on weight
+        Time finish_time = start_time + VirtualClock::duration(packet.length, channel.rate);
+
+        // Save for the next packet from this channel
+        channel.generation = next_generation();
+        channel.last_finish_time = finish_time;
+        if (weight_update_ == WeightUpdate::immediate) details_[slot].head_start_time = start_time;
+        // The finish time is the priority in the priority queue
+        return { channel_id, channel.generation, finish_time };
+    }
+
+    // Returns the packet that dequeue() would transmit next (there must be one).
+    const QueuedPacket& next_packet() {
+        if (!new_entries_.empty()) add_new_entries();
+        if (stale_entries_ != 0) skip_stale_entries();
+        const ChannelInfo& channel = channels_[slots_[active_channels_.top().channel]];
+        return packet_pool_.front(channel.Q);
+    }
+
+    // Adds the entries of the channels that became active since active_channels_ was last used.
+    void add_new_entries() {
+        push_entries(active_channels_, new_entries_);
+        WFQ_COUNT_N(heap_pushes, new_entries_.size());
+        WFQ_COUNT_PEAK(active_channels, active_channels_.size());
+        new_entries_.clear();
+    }
+
+    // Computes the finish time of the packet at the head of an active channel's queue again, after its weight changed,
+    // and replaces the channel's entry in active_channels_ (the old entry becomes stale).
+    void update_head_finish_time(uint32_t slot, uint32_t channel_id) {
+        ChannelInfo& channel = channels_[slot];
+        assert(channel.generation != inactive);
+        Time finish_time = details_[slot].head_start_time +
+            VirtualClock::duration(packet_pool_.front(channel.Q).length, channel.rate);
+        if (finish_time == channel.last_finish_time) return;
+        channel.generation = next_generation();
+        channel.last_finish_time = finish_time;
+        active_channels_.push({ channel_id, channel.generation, finish_time });
+        WFQ_COUNT(heap_pushes);
+        stale_entries_++;
+        if (stale_entries_ > num_active_channels() + compaction_slack) compact_active_channels();
+    }
+
+    // Returns a new generation for an entry of active_channels_. Generations only repeat after 2^32 entries,
+    // and the stale entries are removed before that, so an entry is stale exactly if its generation is not
+    // the channel's generation.
+    uint32_t next_generation() {
+        if (++last_generation_ == inactive) {
+            last_generation_++;
+            if (stale_entries_ != 0) compact_active_channels();
+        }
+        return last_generation_;
+    }
+
+    bool is_stale(const ActiveEntry& entry) const {
+        uint32_t slot = slots_[entry.channel];
+        return slot == no_slot || channels_[slot].generation != entry.generation;
+    }
+
+    // Pops the stale entries at the top of active_channels_.
+    void skip_stale_entries() {
+        while (is_stale(active_channels_.top())) {
+            active_channels_.pop();
+            WFQ_COUNT(heap_pops);
+            stale_entries_--;
+        }
+    }
+
+    // Rebuilds active_channels_ from the active channels, without the stale entries.
+    void compact_active_channels() {
+        active_channels_ = Queue();
+        // The channels whose entries are in new_entries_ are active, so they are added below.
+        new_entries_.clear();
+        for (size_t slot = 0; slot < channels_.size(); slot++) {
+            const ChannelInfo& channel = channels_[slot];
+            if (channel.generation != inactive) {
+                active_channels_.push({ details_[slot].id, channel.generation, channel.last_finish_time });
+            }
+        }
+        stale_entries_ = 0;
+    }
+
+    // Drops the last packet of a channel with at least two packets.
+    Drop drop_last_packet(uint32_t slot) {
+        ChannelInfo& channel = channels_[slot];
+        assert(channel.Q.size >= 2);
+        QueuedPacket packet = std::move(packet_pool_.back(channel.Q));
+        queue_shrinking(slot);
+        packet_pool_.pop_back(channel.Q);
+        num_packets_--;
+        return Drop{ details_[slot].id, packet.length, std::move(packet.payload) };
+    }
+
+    // The lists of channels by the size of their queues are only kept for DropPolicy::longest.
+    bool tracks_queue_sizes() const {
+        return limits_.max_packets != 0 && limits_.drop_policy == DropPolicy::longest;
+    }
+
+    // Returns the slot of a channel with the longest queue, or no_slot if all the queues are empty.
+    uint32_t longest_queue() const {
+        return longest_size_ == 0 ? no_slot : queues_by_size_[longest_size_];
+    }
+
+    // Removes a channel from the list of the given queue size.
+    void unlink_by_size(uint32_t slot, size_t size) {
+        ChannelDetails& channel = details_[slot];
+        if (channel.prev_by_size != no_slot) details_[channel.prev_by_size].next_by_size = channel.next_by_size;
+        else queues_by_size_[size] = channel.next_by_size;
+        if (channel.next_by_size != no_slot) details_[channel.next_by_size].prev_by_size = channel.prev_by_size;
+    }
+
+    // Adds a channel to the list of the given queue size.
+    void link_by_size(uint32_t slot, size_t size) {
+        ChannelDetails& channel = details_[slot];
+        if (size >= queues_by_size_.size()) queues_by_size_.resize(size + 1, no_slot);
+        uint32_t& head = queues_by_size_[size];
+        channel.prev_by_size = no_slot;
+        channel.next_by_size = head;
+        if (head != no_slot) details_[head].prev_by_size = slot;
+        head = slot;
+    }
+
+    // Moves a channel whose queue just grew by one packet to the next list.
+    void queue_grew(uint32_t slot) {
+        if (!tracks_queue_sizes()) return;
+        size_t size = channels_[slot].Q.size;
+        if (size > 1) unlink_by_size(slot, size - 1);
+        link_by_size(slot, size);
+        longest_size_ = std::max(longest_size_, size);
+    }
+
+    // Moves a channel whose queue is about to shrink by one packet to the previous list.
+    void queue_shrinking(uint32_t slot) {
+        if (!tracks_queue_sizes()) return;
+        size_t size = channels_[slot].Q.size;
+        unlink_by_size(slot, size);
+        if (size > 1) link_by_size(slot, size - 1);
+        while (longest_size_ > 0 && queues_by_size_[longest_size_] == no_slot) longest_size_--;
+    }
+
+    WfqLimits limits_;
+    WeightUpdate weight_update_;
+    // Virtual time, which is used to calculate the priority of channels.
+    Time virtual_time_ = 0;
+    // The state of the channels that are in memory, in two parallel arrays indexed by slot.
+    std::vector<ChannelInfo> channels_;
+    std::vector<ChannelDetails> details_;
+    // The slot in channels_ of each channel id, or no_slot.
+    std::vector<uint32_t> slots_;
+    // The unused slots in channels_.
+    std::vector<uint32_t> free_slots_;
+    // The rates of the evicted channels whose weight is not 1.
+    std::unordered_map<uint32_t, Rate> evicted_rates_;
+    // The packets in all the channels' queues.
+    PacketPool<QueuedPacket> packet_pool_;
+    // Channels that have packets ready to send, ordered by priority.
+    Queue active_channels_;
+    // The entries of channels that became active in enqueue(), which are not in active_channels_ yet
+    // (see add_new_entries).
+    std::vector<ActiveEntry> new_entries_;
+    // The number of stale entries in active_channels_ (see WeightUpdate::immediate), and the last generation given
+    // to an entry.
+    size_t stale_entries_ = 0;
+    uint32_t last_generation_ = 0;
+    // The number of packets in all the channels' queues.
+    size_t num_packets_ = 0;
+    // The time when the link finishes transmitting its current packet.
+    uint64_t link_free_time_ = 0;
+    // For DropPolicy::longest: the first slot of the list of channels with each queue size (linked through
+    // ChannelInfo::next_by_size), and the largest size with a non-empty list.
+    std::vector<uint32_t> queues_by_size_;
+    size_t longest_size_ = 0;
+};